@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+#include "shame/common/copy.h"
+
+// working set of the copying core, e.g. state of a control loop, which is evicted by copies
+static const size_t kSizeWorkingSet = 512 * 1024;
+
+/**
+ * @brief seconds spent in f
+ */
+template <typename F>
+double measure(F f) {
+  const auto t = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+/**
+ * @brief read working set, slower if evicted from cache
+ */
+uint64_t touch(const std::vector<uint64_t> &working_set) {
+  uint64_t sum = 0;
+  for (auto v : working_set) {
+    sum += v;
+  }
+  return sum;
+}
+
+int main() {
+  std::vector<uint64_t> working_set(kSizeWorkingSet / sizeof(uint64_t), 1);
+  uint64_t sum = 0;
+
+  std::cout << "Copy throughput in GB/s, and time in us to read a working set of "
+            << kSizeWorkingSet / 1024 << " KB after each copy" << std::endl;
+  std::cout << std::setw(12) << "size" << std::setw(12) << "memcpy" << std::setw(12) << "stream"
+            << std::setw(12) << "read_memcpy" << std::setw(12) << "read_stream" << std::endl;
+
+  for (size_t size = 16 * 1024; size <= 64 * 1024 * 1024; size *= 2) {
+    std::vector<uint8_t> src(size, 1);
+    std::vector<uint8_t> dst(size, 0);
+    const size_t repeat = std::max<size_t>(1, (256 * 1024 * 1024) / size);
+
+    double t_memcpy = 0.0;
+    double t_stream = 0.0;
+    double t_read_memcpy = 0.0;
+    double t_read_stream = 0.0;
+    for (size_t i = 0; i < repeat; ++i) {
+      sum += touch(working_set);
+      t_memcpy += measure([&]() { memcpy(dst.data(), src.data(), size); });
+      t_read_memcpy += measure([&]() { sum += touch(working_set); });
+
+      t_stream += measure([&]() { shame::copyStreaming(dst.data(), src.data(), size); });
+      t_read_stream += measure([&]() { sum += touch(working_set); });
+    }
+
+    const double bytes = static_cast<double>(size) * repeat;
+    std::cout << std::setw(12) << size << std::fixed << std::setprecision(2) << std::setw(12)
+              << bytes / t_memcpy / 1e9 << std::setw(12) << bytes / t_stream / 1e9
+              << std::setw(12) << t_read_memcpy / repeat * 1e6 << std::setw(12)
+              << t_read_stream / repeat * 1e6 << std::endl;
+  }
+
+  // keep reads from being optimized away
+  return sum == 0;
+}
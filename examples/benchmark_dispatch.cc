@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include "shame/shame.h"
+
+// heap allocations of the process, counted by the replaced global operator new
+static std::atomic<uint64_t> num_allocations(0);
+
+void *operator new(size_t size) {
+  num_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static const size_t kNumWarmUp = 10000;
+static const size_t kNumMessages = 1000000;
+
+/**
+ * @brief feeds messages to dispatch as if received from transport
+ */
+class DispatchBenchmark : public shame::Shame {
+ public:
+  DispatchBenchmark() : Shame("239.255.67.76", 6776, 0, "") {}
+
+  /**
+   * @brief dispatch messages queued for the dispatch thread, or inline as polling does
+   * @return heap allocations per message
+   */
+  double run(const std::string &channel, const size_t num, const bool inline_dispatch) {
+    std::shared_ptr<uint8_t> data(new uint8_t[64](), std::default_delete<uint8_t[]>());
+    polling_ = inline_dispatch ? this : nullptr;
+
+    const uint64_t num_allocations_start = num_allocations.load();
+    for (size_t i = 0; i < num; ++i) {
+      callbackReceive(channel, data, 64, false, false);
+      Message msg;
+      if (!inline_dispatch && msg_queue_->dequeue(&msg)) {
+        dispatch(msg);
+      }
+    }
+    polling_ = nullptr;
+    return static_cast<double>(num_allocations.load() - num_allocations_start) / num;
+  }
+};
+
+int main() {
+  DispatchBenchmark benchmark;
+
+  uint64_t num_received = 0;
+  auto callback = [&](const std::string &, const std::shared_ptr<uint8_t> &, const size_t) {
+    ++num_received;
+  };
+  benchmark.subscribe("Benchmark.Dispatch.Channel", callback, nullptr);
+  benchmark.subscribe("Benchmark\\..*", callback, nullptr);
+  benchmark.subscribe("Other", callback, nullptr);
+
+  // channel name longer than small string optimization
+  const std::string channel("Benchmark.Dispatch.Channel");
+  bool ok = true;
+  for (const bool inline_dispatch : {true, false}) {
+    benchmark.run(channel, kNumWarmUp, inline_dispatch);
+
+    const auto t = std::chrono::steady_clock::now();
+    const double allocations = benchmark.run(channel, kNumMessages, inline_dispatch);
+    const double elapsed =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+
+    std::cout << (inline_dispatch ? "inline" : "queued") << ": " << allocations
+              << " allocations per message, " << elapsed / kNumMessages * 1e9
+              << " ns per message" << std::endl;
+    ok = ok && allocations == 0.0;
+  }
+
+  if (num_received != 2 * 2 * (kNumWarmUp + kNumMessages)) {
+    std::cout << "Unexpected number of messages received: " << num_received << std::endl;
+    ok = false;
+  }
+
+  return ok ? 0 : 1;
+}
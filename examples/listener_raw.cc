@@ -20,11 +20,12 @@ void callbackReceiveUdpm(const std::string &channel, const std::shared_ptr<uint8
 
 void callbackReceiveShm(const std::string &channel, const shame::ShameData *shame_data) {
   static int count = 0;
-  shame_data->mutex_.lock_sharable();
+  // without blocking the publisher
+  size_t size = 0;
+  shame_data->read([&size](const uint8_t *, const size_t size_data) { size = size_data; });
   std::cout << "[" << ++count << "]"
-            << " Received " << shame_data->size() << " bytes"
+            << " Received " << size << " bytes"
             << " on channel " << channel << " via shared memory" << std::endl;
-  shame_data->mutex_.unlock_sharable();
 }
 
 int main() {
@@ -34,6 +35,12 @@ int main() {
 
   while (true) {
     std::this_thread::sleep_for(std::chrono::seconds(1));
+    for (const auto &item : shame.statistics()) {
+      std::cout << "Statistics of channel " << item.first << ": " << item.second.num_messages
+                << " received, " << item.second.num_lost << " lost, latency "
+                << item.second.latencyAverage() << " us on average, " << item.second.latency_max
+                << " us at most" << std::endl;
+    }
   }
 
   return 0;
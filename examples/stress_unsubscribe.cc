@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <thread>
+#include "shame/shame.h"
+
+static const size_t kNumRounds = 300;
+static const char *const kChannel = "Stress.Unsubscribe";
+
+int main() {
+  shame::Shame shame("239.255.67.76", 6776, 0, "");
+  shame.startHandling();
+
+  // keeps the channel busy while subscriptions come and go
+  std::atomic<bool> enable_publisher(true);
+  std::thread publisher([&]() {
+    const std::string data(64, 's');
+    while (enable_publisher.load()) {
+      shame.publish(kChannel, data, false);
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+  });
+
+  // last round whose unsubscribe returned, callbacks of that round must not run any more
+  std::atomic<size_t> round_unsubscribed(0);
+  std::atomic<uint64_t> num_late(0);
+  std::mt19937 engine(std::random_device{}());
+  std::uniform_int_distribution<int> lifetime_us(0, 2000);
+
+  bool ok = true;
+  size_t round = 0;
+  for (const auto policy : {shame::DeliveryPolicy::kKeepAll, shame::DeliveryPolicy::kKeepLast,
+                            shame::DeliveryPolicy::kConflate}) {
+    std::atomic<uint64_t> num_received(0);
+    const uint64_t num_late_start = num_late.load();
+    for (size_t i = 0; i < kNumRounds; ++i) {
+      ++round;
+      auto callback = [&, round](const std::string &, const std::shared_ptr<uint8_t> &,
+                                 const size_t) {
+        ++num_received;
+        // widen the window for unsubscribe to race with this callback
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        if (round_unsubscribed.load() >= round) {
+          ++num_late;
+        }
+      };
+      auto subscription = shame.subscribe(kChannel, callback, nullptr, policy, 4);
+      std::this_thread::sleep_for(std::chrono::microseconds(lifetime_us(engine)));
+      shame.unsubscribe(subscription);
+      round_unsubscribed.store(round);
+    }
+
+    const uint64_t late = num_late.load() - num_late_start;
+    std::cout << "policy " << static_cast<int>(policy) << ": " << kNumRounds << " rounds, "
+              << num_received.load() << " messages, " << late << " callbacks after unsubscribe"
+              << std::endl;
+    ok = ok && late == 0 && num_received.load() > 0;
+  }
+
+  enable_publisher.store(false);
+  publisher.join();
+  return ok ? 0 : 1;
+}
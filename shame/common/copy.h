@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHAME_COPY_X86
+#endif
+
+namespace shame {
+
+// messages of this size or larger are copied with non-temporal stores, bypassing cache, see
+// examples/benchmark_copy for the crossover on a given machine
+static const size_t kMinSizeStreamingCopy = 1024 * 1024;
+
+#ifdef SHAME_COPY_X86
+/**
+ * @brief copy with SSE2 non-temporal stores, available on every x86-64 cpu
+ */
+inline void copyStreamingSse2(void *dst, const void *src, size_t size) {
+  auto d = reinterpret_cast<uint8_t *>(dst);
+  auto s = reinterpret_cast<const uint8_t *>(src);
+
+  // align destination for stores
+  const size_t len_head = (16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15;
+  if (len_head >= size) {
+    memcpy(d, s, size);
+    return;
+  }
+  memcpy(d, s, len_head);
+  d += len_head;
+  s += len_head;
+  size -= len_head;
+
+  for (; size >= 64; size -= 64, d += 64, s += 64) {
+    const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+    const auto b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 16));
+    const auto c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 32));
+    const auto e = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 48));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(d), a);
+    _mm_stream_si128(reinterpret_cast<__m128i *>(d + 16), b);
+    _mm_stream_si128(reinterpret_cast<__m128i *>(d + 32), c);
+    _mm_stream_si128(reinterpret_cast<__m128i *>(d + 48), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+
+/**
+ * @brief copy with AVX2 non-temporal stores
+ */
+__attribute__((target("avx2"))) inline void copyStreamingAvx2(void *dst, const void *src,
+                                                               size_t size) {
+  auto d = reinterpret_cast<uint8_t *>(dst);
+  auto s = reinterpret_cast<const uint8_t *>(src);
+
+  const size_t len_head = (32 - (reinterpret_cast<uintptr_t>(d) & 31)) & 31;
+  if (len_head >= size) {
+    memcpy(d, s, size);
+    return;
+  }
+  memcpy(d, s, len_head);
+  d += len_head;
+  s += len_head;
+  size -= len_head;
+
+  for (; size >= 128; size -= 128, d += 128, s += 128) {
+    const auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+    const auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 32));
+    const auto c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 64));
+    const auto e = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + 96));
+    _mm256_stream_si256(reinterpret_cast<__m256i *>(d), a);
+    _mm256_stream_si256(reinterpret_cast<__m256i *>(d + 32), b);
+    _mm256_stream_si256(reinterpret_cast<__m256i *>(d + 64), c);
+    _mm256_stream_si256(reinterpret_cast<__m256i *>(d + 96), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+
+/**
+ * @brief copy with AVX-512 non-temporal stores
+ */
+__attribute__((target("avx512f"))) inline void copyStreamingAvx512(void *dst, const void *src,
+                                                                    size_t size) {
+  auto d = reinterpret_cast<uint8_t *>(dst);
+  auto s = reinterpret_cast<const uint8_t *>(src);
+
+  const size_t len_head = (64 - (reinterpret_cast<uintptr_t>(d) & 63)) & 63;
+  if (len_head >= size) {
+    memcpy(d, s, size);
+    return;
+  }
+  memcpy(d, s, len_head);
+  d += len_head;
+  s += len_head;
+  size -= len_head;
+
+  for (; size >= 256; size -= 256, d += 256, s += 256) {
+    const auto a = _mm512_loadu_si512(s);
+    const auto b = _mm512_loadu_si512(s + 64);
+    const auto c = _mm512_loadu_si512(s + 128);
+    const auto e = _mm512_loadu_si512(s + 192);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(d), a);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(d + 64), b);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(d + 128), c);
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(d + 192), e);
+  }
+  _mm_sfence();
+  memcpy(d, s, size);
+}
+#endif
+
+/**
+ * @brief copy with non-temporal stores of the widest instruction set supported by cpu, data
+ * copied is not left in cache of the calling core
+ */
+inline void copyStreaming(void *dst, const void *src, const size_t size) {
+#ifdef SHAME_COPY_X86
+  using Copy = void (*)(void *, const void *, size_t);
+  static const Copy copy = []() -> Copy {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return copyStreamingAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+      return copyStreamingAvx2;
+    }
+    return copyStreamingSse2;
+  }();
+  copy(dst, src, size);
+#else
+  memcpy(dst, src, size);
+#endif
+}
+
+/**
+ * @brief copy payload, large messages are copied with non-temporal stores as they are not read
+ * again by the copying core
+ * @param dst destination
+ * @param src source
+ * @param size length in bytes to be copied
+ * @param size_message size of the whole message the copied part belongs to, 0 for size
+ */
+inline void copy(void *dst, const void *src, const size_t size, const size_t size_message = 0) {
+  if ((size_message > 0 ? size_message : size) >= kMinSizeStreamingCopy) {
+    copyStreaming(dst, src, size);
+  } else {
+    memcpy(dst, src, size);
+  }
+}
+
+}  // namespace shame
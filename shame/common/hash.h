@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace shame {
+
+/**
+ * @brief 64-bit FNV-1a hash
+ */
+inline uint64_t fnv1a64(const void *data, const size_t size) {
+  auto p = reinterpret_cast<const uint8_t *>(data);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/**
+ * @brief get id of channel carried on the wire instead of channel name, never 0
+ */
+inline uint64_t channelId(const std::string &channel) {
+  const auto hash = fnv1a64(channel.data(), channel.size());
+  return (hash == 0 ? 1 : hash);
+}
+
+}  // namespace shame
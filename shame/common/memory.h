@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// not defined by headers older than Linux 5.14
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+namespace shame {
+
+/**
+ * @brief map all pages of a shared mapping in advance, so that the first access does not fault
+ * @param address page aligned address of mapping
+ * @param size length of mapping in bytes
+ */
+inline void prefault(void *address, const size_t size) {
+  if (madvise(address, size, MADV_POPULATE_WRITE) == 0) {
+    return;
+  }
+
+  // touch every page on kernels without MADV_POPULATE_WRITE
+  const size_t size_page = sysconf(_SC_PAGESIZE);
+  auto p = reinterpret_cast<volatile const uint8_t *>(address);
+  for (size_t offset = 0; offset < size; offset += size_page) {
+    (void)p[offset];
+  }
+}
+
+/**
+ * @brief advise transparent huge pages for a mapping
+ * @param address page aligned address of mapping
+ * @param size length of mapping in bytes
+ * @return false if not supported
+ */
+inline bool adviseHugePages(void *address, const size_t size) {
+#ifdef MADV_HUGEPAGE
+  return madvise(address, size, MADV_HUGEPAGE) == 0;
+#else
+  (void)address;
+  (void)size;
+  return false;
+#endif
+}
+
+// name of object constructed in a segment backed by huge pages, so that clients advise them too
+static const char *const kNameHugePages = "shame_huge_pages";
+
+/**
+ * @brief whether transparent huge pages advised for POSIX shared memory take effect, i.e. /dev/shm
+ * is mounted with huge= one of always, within_size and advise, unless overridden by force or deny
+ * in shmem_enabled of the kernel, which otherwise governs internal shared memory only
+ */
+inline bool hugePagesEnabledForSharedMemory() {
+  std::ifstream file_enabled("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+  std::string line;
+  std::getline(file_enabled, line);
+  if (line.find("[force]") != std::string::npos) {
+    return true;
+  }
+  if (line.find("[deny]") != std::string::npos) {
+    return false;
+  }
+
+  // the last mount on /dev/shm shadows the others, huge=never by default
+  std::ifstream file_mounts("/proc/mounts");
+  std::string huge("never");
+  while (std::getline(file_mounts, line)) {
+    std::istringstream fields(line);
+    std::string device, mount_point, type, options;
+    fields >> device >> mount_point >> type >> options;
+    if (mount_point != "/dev/shm") {
+      continue;
+    }
+    huge = "never";
+    const auto pos = options.find("huge=");
+    if (pos != std::string::npos) {
+      huge = options.substr(pos + 5, options.find(',', pos) - pos - 5);
+    }
+  }
+  return huge == "always" || huge == "within_size" || huge == "advise";
+}
+
+}  // namespace shame
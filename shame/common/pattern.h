@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <cstring>
+#include <regex>
+#include <string>
+
+namespace shame {
+
+/**
+ * @brief get the channel name a pattern subscribed stands for, if it has no metacharacters
+ * besides '.', which channel names use as a separator, and escaped ones
+ * @param pattern regex of channel names
+ * @param channel set to channel name if literal
+ * @return whether pattern is literal
+ */
+inline bool literalPattern(const std::string &pattern, std::string *channel) {
+  static const char *const kMetacharacters = "^$|?*+()[]{}";
+  channel->clear();
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    char c = pattern[i];
+    if (c == '\\') {
+      // escaped metacharacters only, as others, e.g. \d, are classes
+      if (i + 1 == pattern.size() || (pattern[i + 1] != '.' && pattern[i + 1] != '\\' &&
+                                      !strchr(kMetacharacters, pattern[i + 1]))) {
+        return false;
+      }
+      c = pattern[++i];
+    } else if (strchr(kMetacharacters, c)) {
+      return false;
+    }
+    channel->push_back(c);
+  }
+  return true;
+}
+
+/**
+ * @brief whether channel matches pattern subscribed, compared without regex if literal, see
+ * literalPattern
+ */
+inline bool matchesPattern(const std::string &channel, const std::string &pattern) {
+  std::string literal;
+  if (literalPattern(pattern, &literal)) {
+    return channel == literal;
+  }
+  return std::regex_match(channel, std::regex(pattern));
+}
+
+}  // namespace shame
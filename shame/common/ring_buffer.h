@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace shame {
+
+/**
+ * @brief FIFO on a contiguous buffer, which grows when full and never shrinks, so that it does not
+ * allocate once it reached its working size
+ */
+template <typename T>
+class RingBuffer {
+ public:
+  bool empty() const { return size_ == 0; }
+
+  size_t size() const { return size_; }
+
+  T &front() { return buffer_[head_]; }
+
+  void push(const T &element) {
+    if (size_ == buffer_.size()) {
+      grow();
+    }
+    buffer_[(head_ + size_) % buffer_.size()] = element;
+    ++size_;
+  }
+
+  void pop() {
+    // release resources held by element
+    buffer_[head_] = T();
+    head_ = (head_ + 1) % buffer_.size();
+    --size_;
+  }
+
+  void clear() {
+    while (!empty()) {
+      pop();
+    }
+  }
+
+ protected:
+  void grow() {
+    std::vector<T> buffer(std::max<size_t>(16, buffer_.size() * 2));
+    for (size_t i = 0; i < size_; ++i) {
+      buffer[i] = std::move(buffer_[(head_ + i) % buffer_.size()]);
+    }
+    buffer_.swap(buffer);
+    head_ = 0;
+  }
+
+ protected:
+  std::vector<T> buffer_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+};
+
+}  // namespace shame
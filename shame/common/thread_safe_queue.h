@@ -8,77 +8,254 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <mutex>
-#include <queue>
 #include <utility>
+#include "shame/common/ring_buffer.h"
 
 namespace shame {
 
+enum class OverflowPolicy {
+  // wait for space
+  kBlock,
+  // drop the oldest element to make space
+  kDropOldest,
+  // drop the element being enqueued
+  kDropNewest,
+};
+
+// lanes of elements to dequeue from, elements of the urgent lane overtake the others
+enum class Lane {
+  // either lane, urgent first
+  kAny,
+  kNormal,
+  kUrgent,
+};
+
+struct QueueOptions {
+  // max number of elements per lane, 0 for unlimited
+  size_t capacity = 0;
+  OverflowPolicy policy = OverflowPolicy::kDropOldest;
+};
+
+struct QueueStatistics {
+  size_t size = 0;
+  size_t capacity = 0;
+  // number of elements dropped on overflow
+  uint64_t num_dropped = 0;
+};
+
 template <typename T>
 class ThreadSafeQueue {
  public:
-  ThreadSafeQueue() = default;
+  /**
+   * @brief constructor of ThreadSafeQueue
+   * @param capacity max number of elements per lane, 0 for unlimited
+   * @param policy what to do on overflow
+   */
+  explicit ThreadSafeQueue(const size_t capacity = 0,
+                           const OverflowPolicy policy = OverflowPolicy::kDropOldest)
+      : capacity_(capacity), policy_(policy) {}
   ThreadSafeQueue(const ThreadSafeQueue &) = delete;
   ThreadSafeQueue &operator=(const ThreadSafeQueue &) = delete;
 
  public:
-  void enqueue(const T &element) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    queue_.emplace(element);
-    cv_.notify_one();
+  /**
+   * @brief enqueue element, handles overflow of its lane according to policy
+   * @param element element to enqueue
+   * @param urgent whether enqueued to the urgent lane
+   * @return false if element dropped, or wait broken by breakAllWait()
+   */
+  bool enqueue(const T &element, const bool urgent = false) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto &queue = (urgent ? queue_urgent_ : queue_);
+    if (capacity_ > 0 && queue.size() >= capacity_) {
+      switch (policy_) {
+        case OverflowPolicy::kBlock:
+          cv_not_full_.wait(lock, [&]() {
+            return break_all_wait_.load() || capacity_ == 0 || queue.size() < capacity_;
+          });
+          if (break_all_wait_.load()) {
+            return false;
+          }
+          break;
+        case OverflowPolicy::kDropOldest:
+          while (queue.size() >= capacity_) {
+            queue.pop();
+            ++num_dropped_;
+          }
+          break;
+        case OverflowPolicy::kDropNewest:
+          ++num_dropped_;
+          return false;
+      }
+    }
+    queue.push(element);
+    // waiters of the other lane are left asleep
+    (urgent ? cv_urgent_ : cv_).notify_one();
+    if (num_waiting_any_ > 0) {
+      cv_any_.notify_one();
+    }
+    return true;
   }
 
-  bool dequeue(T *element) {
+  bool dequeue(T *element, const Lane lane = Lane::kAny) {
     std::lock_guard<std::mutex> lock(mutex_);
-    if (queue_.empty()) {
+    return pop(element, lane);
+  }
+
+  bool waitDequeue(T *element, const Lane lane = Lane::kAny) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Waiting waiting(this, lane);
+    waiting.cv.wait(lock, [&]() { return break_all_wait_.load() || !empty(lane); });
+    if (break_all_wait_.load()) {
       return false;
     }
-    *element = std::move(queue_.front());
-    queue_.pop();
-    return true;
+    return pop(element, lane);
   }
 
-  bool waitDequeue(T *element) {
+  /**
+   * @brief wait for an element up to timeout
+   * @return false on timeout, or wait broken by breakAllWait()
+   */
+  bool waitDequeueFor(T *element, const std::chrono::microseconds &timeout,
+                      const Lane lane = Lane::kAny) {
     std::unique_lock<std::mutex> lock(mutex_);
-    cv_.wait(lock, [&]() { return break_all_wait_.load() || !queue_.empty(); });
-    if (break_all_wait_.load()) {
+    Waiting waiting(this, lane);
+    if (!waiting.cv.wait_for(lock, timeout,
+                             [&]() { return break_all_wait_.load() || !empty(lane); }) ||
+        break_all_wait_.load()) {
       return false;
     }
-    *element = std::move(queue_.front());
-    queue_.pop();
-    return true;
+    return pop(element, lane);
   }
 
-  typename std::queue<T>::size_type size() {
+  size_t size() {
     std::lock_guard<std::mutex> lock(mutex_);
-    return queue_.size();
+    return queue_.size() + queue_urgent_.size();
   }
 
   bool empty() {
     std::lock_guard<std::mutex> lock(mutex_);
-    return queue_.empty();
+    return empty(Lane::kAny);
   }
 
   void clear() {
     std::lock_guard<std::mutex> lock(mutex_);
-    while (!queue_.empty()) {
-      queue_.pop();
-    }
+    queue_.clear();
+    queue_urgent_.clear();
+    cv_not_full_.notify_all();
   }
 
   void breakAllWait() {
     break_all_wait_.store(true);
+    // locked so that no waiter misses the flag between checking it and sleeping
+    std::lock_guard<std::mutex> lock(mutex_);
     cv_.notify_all();
+    cv_urgent_.notify_all();
+    cv_any_.notify_all();
+    cv_not_full_.notify_all();
   }
 
   void reset() { break_all_wait_.store(false); }
 
+  /**
+   * @brief change capacity and overflow policy, elements beyond capacity are kept
+   */
+  void setOptions(const QueueOptions &options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = options.capacity;
+    policy_ = options.policy;
+    cv_not_full_.notify_all();
+  }
+
+  /**
+   * @brief get number of elements dropped on overflow
+   */
+  uint64_t numDropped() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_dropped_;
+  }
+
+  /**
+   * @brief get size, capacity and number of dropped elements
+   */
+  QueueStatistics statistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueueStatistics statistics;
+    statistics.size = queue_.size() + queue_urgent_.size();
+    statistics.capacity = capacity_;
+    statistics.num_dropped = num_dropped_;
+    return statistics;
+  }
+
+  /**
+   * @brief whether a lane of a bounded queue is filled to half of its capacity or more
+   */
+  bool congested() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_ > 0 && std::max(queue_.size(), queue_urgent_.size()) * 2 >= capacity_;
+  }
+
+ protected:
+  /**
+   * @brief waiter of a lane, with mutex_ locked, waiters of either lane are counted so that
+   * enqueuing wakes them only if there are any
+   */
+  struct Waiting {
+    Waiting(ThreadSafeQueue *queue, const Lane lane)
+        : queue(queue),
+          cv(lane == Lane::kNormal ? queue->cv_
+                                   : (lane == Lane::kUrgent ? queue->cv_urgent_ : queue->cv_any_)),
+          any(lane == Lane::kAny) {
+      queue->num_waiting_any_ += any;
+    }
+    ~Waiting() { queue->num_waiting_any_ -= any; }
+
+    ThreadSafeQueue *queue;
+    std::condition_variable &cv;
+    const bool any;
+  };
+
+  /**
+   * @brief inner function to tell whether lane is empty, with mutex_ locked
+   */
+  bool empty(const Lane lane) const {
+    return (lane == Lane::kNormal || queue_urgent_.empty()) &&
+           (lane == Lane::kUrgent || queue_.empty());
+  }
+
+  /**
+   * @brief inner function to pop the front element of lane, with mutex_ locked
+   */
+  bool pop(T *element, const Lane lane) {
+    if (empty(lane)) {
+      return false;
+    }
+    auto &queue = ((lane == Lane::kNormal || queue_urgent_.empty()) ? queue_ : queue_urgent_);
+    *element = std::move(queue.front());
+    queue.pop();
+    cv_not_full_.notify_all();
+    return true;
+  }
+
  protected:
-  std::queue<T> queue_;
+  size_t capacity_;
+  OverflowPolicy policy_;
+  uint64_t num_dropped_ = 0;
+  RingBuffer<T> queue_;
+  RingBuffer<T> queue_urgent_;
   std::mutex mutex_;
+  // waiters of the normal lane, of the urgent lane and of either lane
   std::condition_variable cv_;
+  std::condition_variable cv_urgent_;
+  std::condition_variable cv_any_;
+  size_t num_waiting_any_ = 0;
+  std::condition_variable cv_not_full_;
   std::atomic<bool> break_all_wait_{false};
 };
 
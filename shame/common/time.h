@@ -25,6 +25,16 @@ inline uint64_t now() {
       .count();
 }
 
+/**
+ * @brief get current monotonic timestamp in microseconds
+ * @note comparable between processes on the same host only
+ */
+inline uint64_t nowMonotonic() {
+  return (std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now().time_since_epoch()))
+      .count();
+}
+
 class Clock {
  public:
   /**
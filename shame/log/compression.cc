@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include "shame/log/compression.h"
+#include <cstring>
+#include "shame/log/log.h"
+#ifdef SHAME_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace shame {
+
+bool logCompressionSupported(const uint32_t compression) {
+#ifdef SHAME_WITH_ZLIB
+  return compression == kLogCompressionNone || compression == kLogCompressionZlib;
+#else
+  return compression == kLogCompressionNone;
+#endif
+}
+
+size_t logCompress(const uint32_t compression, const void *data, const size_t size,
+                   std::vector<uint8_t> *compressed) {
+  switch (compression) {
+    case kLogCompressionNone:
+      if (compressed->size() < size) {
+        compressed->resize(size);
+      }
+      memcpy(compressed->data(), data, size);
+      return size;
+#ifdef SHAME_WITH_ZLIB
+    case kLogCompressionZlib: {
+      uLongf len = compressBound(size);
+      if (compressed->size() < len) {
+        compressed->resize(len);
+      }
+      // favor speed, recording must keep up with the traffic
+      if (compress2(compressed->data(), &len, reinterpret_cast<const Bytef *>(data), size,
+                    Z_BEST_SPEED) != Z_OK) {
+        return 0;
+      }
+      return len;
+    }
+#endif
+    default:
+      return 0;
+  }
+}
+
+bool logDecompress(const uint32_t compression, const void *data, const size_t size,
+                   void *decompressed, const size_t len_raw) {
+  switch (compression) {
+    case kLogCompressionNone:
+      if (size != len_raw) {
+        return false;
+      }
+      memcpy(decompressed, data, size);
+      return true;
+#ifdef SHAME_WITH_ZLIB
+    case kLogCompressionZlib: {
+      uLongf len = len_raw;
+      return uncompress(reinterpret_cast<Bytef *>(decompressed), &len,
+                        reinterpret_cast<const Bytef *>(data), size) == Z_OK &&
+             len == len_raw;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+}  // namespace shame
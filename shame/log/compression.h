@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace shame {
+
+/**
+ * @brief check whether compression of log block is supported by this build
+ * @param compression kLogCompressionXXX
+ */
+bool logCompressionSupported(const uint32_t compression);
+
+/**
+ * @brief compress data
+ * @param compression kLogCompressionXXX
+ * @param data pointer to data
+ * @param size length of data in bytes
+ * @param compressed buffer of compressed data, grown if not large enough
+ * @return length of compressed data in bytes, 0 on fail
+ */
+size_t logCompress(const uint32_t compression, const void *data, const size_t size,
+                   std::vector<uint8_t> *compressed);
+
+/**
+ * @brief decompress data
+ * @param compression kLogCompressionXXX
+ * @param data pointer to compressed data
+ * @param size length of compressed data in bytes
+ * @param decompressed pointer to buffer of decompressed data
+ * @param len_raw length of decompressed data in bytes
+ * @return true on success
+ */
+bool logDecompress(const uint32_t compression, const void *data, const size_t size,
+                   void *decompressed, const size_t len_raw);
+
+}  // namespace shame
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Layout of log file, all integers in host byte order:
+ *
+ *   FileHeader
+ *   BlockHeader, records of block
+ *   ...
+ *   BlockHeader, records of block
+ *   index
+ *   Footer
+ *
+ * Records of a block are RecordHeader, channel name and data, one by one, stored as is or
+ * compressed as a whole according to compression of BlockHeader.
+ *
+ * Index is the channel table followed by one entry per block:
+ *   uint32_t num_channels, then uint32_t length and characters per channel name
+ *   uint32_t num_blocks, then BlockIndex and uint32_t ids of channels per block
+ *
+ * A log without footer (e.g. the logger was killed) is still readable, its index is rebuilt by
+ * scanning blocks.
+ */
+
+namespace shame {
+
+static const uint32_t kMagicLogFile = 0x474c4853;    // "SHLG"
+static const uint32_t kMagicLogBlock = 0x4b4c4253;   // "SBLK"
+static const uint32_t kMagicLogFooter = 0x544f4653;  // "SFOT"
+static const uint32_t kVersionLog = 2;
+
+// compression of block
+static const uint32_t kLogCompressionNone = 0;
+static const uint32_t kLogCompressionZlib = 1;
+
+// flags of record
+static const uint32_t kLogRecordSharedMemory = 0x1;
+
+struct LogFileHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct LogBlockHeader {
+  uint32_t magic;
+  uint32_t num_records;
+  uint32_t compression;
+  uint32_t reserved;
+  // length of stored (maybe compressed) records in bytes
+  uint64_t len_data;
+  // length of records in bytes
+  uint64_t len_raw;
+  // timestamps of first and last record in microseconds
+  uint64_t t_first;
+  uint64_t t_last;
+};
+
+struct LogRecordHeader {
+  // timestamp of receiving in microseconds
+  uint64_t timestamp;
+  uint32_t len_channel;
+  uint32_t len_data;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct LogBlockIndex {
+  // offset of BlockHeader from beginning of file
+  uint64_t offset;
+  uint64_t t_first;
+  uint64_t t_last;
+  uint32_t num_records;
+  uint32_t num_channels;
+};
+
+struct LogFooter {
+  uint64_t offset_index;
+  uint64_t len_index;
+  uint32_t magic;
+  uint32_t version;
+};
+
+}  // namespace shame
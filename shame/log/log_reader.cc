@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include "shame/log/log_reader.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include "shame/log/compression.h"
+
+namespace bi = boost::interprocess;
+
+namespace shame {
+
+LogReader::LogReader(const std::string &path)
+    : file_(path.c_str(), bi::read_only), region_(file_, bi::read_only) {
+  data_ = reinterpret_cast<const uint8_t *>(region_.get_address());
+  size_ = region_.get_size();
+  region_.advise(bi::mapped_region::advice_sequential);
+
+  LogFileHeader header;
+  if (size_ < sizeof(header)) {
+    throw std::runtime_error("Invalid log file " + path);
+  }
+  memcpy(&header, data_, sizeof(header));
+  if (header.magic != kMagicLogFile || header.version != kVersionLog) {
+    throw std::runtime_error("Invalid log file " + path);
+  }
+
+  if (!loadIndex()) {
+    scanIndex();
+  }
+}
+
+size_t LogReader::seek(const uint64_t timestamp) const {
+  auto it = std::lower_bound(
+      blocks_.begin(), blocks_.end(), timestamp,
+      [](const LogBlock &block, const uint64_t t) { return block.index.t_last < t; });
+  return it - blocks_.begin();
+}
+
+bool LogReader::readRawBlock(const size_t block, LogBlockHeader *header,
+                             const uint8_t **data) const {
+  if (block >= blocks_.size()) {
+    return false;
+  }
+
+  const auto offset = blocks_[block].index.offset;
+  if (offset + sizeof(*header) > size_) {
+    return false;
+  }
+  memcpy(header, data_ + offset, sizeof(*header));
+  if (header->magic != kMagicLogBlock || offset + sizeof(*header) + header->len_data > size_) {
+    return false;
+  }
+
+  *data = data_ + offset + sizeof(*header);
+  return true;
+}
+
+bool LogReader::readBlock(const size_t block,
+                          const std::function<bool(const LogRecord &)> &callback) const {
+  LogBlockHeader header;
+  const uint8_t *p;
+  if (!readRawBlock(block, &header, &p)) {
+    return false;
+  }
+
+  std::vector<uint8_t> records;
+  if (header.compression != kLogCompressionNone) {
+    if (!logCompressionSupported(header.compression)) {
+      std::cout << "Compression " << header.compression << " is not supported by this build"
+                << std::endl;
+      return false;
+    }
+    records.resize(header.len_raw);
+    if (!logDecompress(header.compression, p, header.len_data, records.data(), records.size())) {
+      return false;
+    }
+    p = records.data();
+  }
+
+  // names of records are resolved against channels of block, consecutive records mostly share one
+  const auto &ids = blocks_[block].channels;
+  const auto end = p + header.len_raw;
+  LogRecord record;
+  record.channel_id = kLogChannelUnknown;
+  for (uint32_t i = 0; i < header.num_records; ++i) {
+    LogRecordHeader record_header;
+    if (p + sizeof(record_header) > end) {
+      return false;
+    }
+    memcpy(&record_header, p, sizeof(record_header));
+    p += sizeof(record_header);
+    if (p + record_header.len_channel + record_header.len_data > end) {
+      return false;
+    }
+
+    record.timestamp = record_header.timestamp;
+    record.channel.assign(reinterpret_cast<const char *>(p), record_header.len_channel);
+    if (record.channel_id == kLogChannelUnknown || channels_[record.channel_id] != record.channel) {
+      record.channel_id = kLogChannelUnknown;
+      for (auto id : ids) {
+        if (channels_[id] == record.channel) {
+          record.channel_id = id;
+          break;
+        }
+      }
+    }
+    record.data = p + record_header.len_channel;
+    record.size = record_header.len_data;
+    record.shared_memory = (record_header.flags & kLogRecordSharedMemory);
+    p += record_header.len_channel + record_header.len_data;
+
+    if (!callback(record)) {
+      break;
+    }
+  }
+
+  return true;
+}
+
+bool LogReader::loadIndex() {
+  LogFooter footer;
+  if (size_ < sizeof(LogFileHeader) + sizeof(footer)) {
+    return false;
+  }
+  memcpy(&footer, data_ + size_ - sizeof(footer), sizeof(footer));
+  if (footer.magic != kMagicLogFooter || footer.version != kVersionLog ||
+      footer.offset_index + footer.len_index + sizeof(footer) != size_) {
+    return false;
+  }
+
+  auto p = data_ + footer.offset_index;
+  const auto end = p + footer.len_index;
+  auto read = [&p, end](void *dst, const size_t size) {
+    if (size > static_cast<size_t>(end - p)) {
+      return false;
+    }
+    memcpy(dst, p, size);
+    p += size;
+    return true;
+  };
+
+  // counts are checked against bytes left before allocating, in case the index is corrupted
+  uint32_t num_channels;
+  if (!read(&num_channels, sizeof(num_channels)) ||
+      num_channels > static_cast<size_t>(end - p) / sizeof(uint32_t)) {
+    return false;
+  }
+  std::vector<std::string> channels(num_channels);
+  for (auto &channel : channels) {
+    uint32_t len;
+    if (!read(&len, sizeof(len)) || len > static_cast<size_t>(end - p)) {
+      return false;
+    }
+    channel.assign(reinterpret_cast<const char *>(p), len);
+    p += len;
+  }
+
+  uint32_t num_blocks;
+  if (!read(&num_blocks, sizeof(num_blocks)) ||
+      num_blocks > static_cast<size_t>(end - p) / sizeof(LogBlockIndex)) {
+    return false;
+  }
+  std::vector<LogBlock> blocks(num_blocks);
+  for (auto &block : blocks) {
+    if (!read(&block.index, sizeof(block.index)) ||
+        block.index.num_channels > static_cast<size_t>(end - p) / sizeof(uint32_t)) {
+      return false;
+    }
+    block.channels.resize(block.index.num_channels);
+    if (!read(block.channels.data(), block.channels.size() * sizeof(uint32_t))) {
+      return false;
+    }
+
+    // ids index the channel table, by readBlock and by tools selecting channels
+    for (auto id : block.channels) {
+      if (id >= num_channels) {
+        std::cout << "Channel " << id << " of block at offset " << block.index.offset
+                  << " is out of range of " << num_channels << " channels in log index, scanning "
+                  << "blocks instead" << std::endl;
+        return false;
+      }
+    }
+  }
+
+  channels_.swap(channels);
+  blocks_.swap(blocks);
+  return true;
+}
+
+void LogReader::scanIndex() {
+  std::unordered_map<std::string, uint32_t> ids;
+  size_t offset = sizeof(LogFileHeader);
+  LogBlockHeader header;
+  while (offset + sizeof(header) <= size_) {
+    memcpy(&header, data_ + offset, sizeof(header));
+    if (header.magic != kMagicLogBlock || offset + sizeof(header) + header.len_data > size_) {
+      break;
+    }
+
+    LogBlock block;
+    block.index.offset = offset;
+    block.index.t_first = header.t_first;
+    block.index.t_last = header.t_last;
+    block.index.num_records = header.num_records;
+    blocks_.push_back(block);
+
+    std::set<uint32_t> channels;
+    if (!readBlock(blocks_.size() - 1, [&](const LogRecord &record) {
+          auto it = ids.find(record.channel);
+          if (it == ids.end()) {
+            it = ids.emplace(record.channel, static_cast<uint32_t>(channels_.size())).first;
+            channels_.push_back(record.channel);
+          }
+          channels.insert(it->second);
+          return true;
+        })) {
+      blocks_.pop_back();
+      break;
+    }
+    blocks_.back().channels.assign(channels.begin(), channels.end());
+    blocks_.back().index.num_channels = channels.size();
+
+    offset += sizeof(header) + header.len_data;
+  }
+}
+
+}  // namespace shame
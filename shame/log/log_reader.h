@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "shame/log/log.h"
+
+namespace shame {
+
+// id of a channel not indexed yet, see LogRecord::channel_id
+static const uint32_t kLogChannelUnknown = 0xffffffff;
+
+struct LogRecord {
+  uint64_t timestamp;
+  std::string channel;
+  // id of channel, see LogReader::channels(), kLogChannelUnknown while scanning for index
+  uint32_t channel_id;
+  const uint8_t *data;
+  size_t size;
+  bool shared_memory;
+};
+
+struct LogBlock {
+  LogBlockIndex index;
+  // ids of channels in this block, see LogReader::channels()
+  std::vector<uint32_t> channels;
+};
+
+class LogReader {
+ public:
+  /**
+   * @brief constructor of LogReader, memory map log file (read only, throws on fail)
+   * @param path path of log file
+   */
+  explicit LogReader(const std::string &path);
+
+ public:
+  /**
+   * @brief get names of all channels, indexed by channel id
+   */
+  const std::vector<std::string> &channels() const { return channels_; }
+
+  /**
+   * @brief get index of all blocks, ordered by offset in file
+   */
+  const std::vector<LogBlock> &blocks() const { return blocks_; }
+
+  /**
+   * @brief find the first block which may contain records at or after timestamp
+   * @param timestamp timestamp in microseconds
+   * @return index of block, blocks().size() for none
+   */
+  size_t seek(const uint64_t timestamp) const;
+
+  /**
+   * @brief read records of a block one by one
+   * @param block index of block
+   * @param callback callback function on each record, return false to stop reading
+   * @return false if block is corrupted
+   */
+  bool readBlock(const size_t block, const std::function<bool(const LogRecord &)> &callback) const;
+
+  /**
+   * @brief get stored block as is, without decompressing
+   * @param block index of block
+   * @param header header of block
+   * @param data pointer to stored data of block, valid during lifetime of reader
+   * @return false if block is corrupted
+   */
+  bool readRawBlock(const size_t block, LogBlockHeader *header, const uint8_t **data) const;
+
+  /**
+   * @brief get timestamp of the first record in microseconds
+   */
+  uint64_t startTime() const { return blocks_.empty() ? 0 : blocks_.front().index.t_first; }
+
+  /**
+   * @brief get timestamp of the last record in microseconds
+   */
+  uint64_t endTime() const { return blocks_.empty() ? 0 : blocks_.back().index.t_last; }
+
+ protected:
+  /**
+   * @brief inner function to load index from footer, false if no valid footer found
+   */
+  bool loadIndex();
+
+  /**
+   * @brief inner function to rebuild index by scanning blocks
+   */
+  void scanIndex();
+
+ protected:
+  boost::interprocess::file_mapping file_;
+  boost::interprocess::mapped_region region_;
+  const uint8_t *data_;
+  size_t size_;
+
+  std::vector<std::string> channels_;
+  std::vector<LogBlock> blocks_;
+};
+
+}  // namespace shame
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include "shame/log/log_writer.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "shame/common/copy.h"
+#include "shame/common/thread_safe_queue.h"
+#include "shame/log/compression.h"
+
+namespace shame {
+
+LogWriter::LogWriter(const std::string &path, const size_t size_block, const uint32_t compression,
+                     const size_t num_threads_compression)
+    : size_block_(size_block),
+      compression_(logCompressionSupported(compression) ? compression : kLogCompressionNone),
+      fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+      offset_(0),
+      active_(nullptr),
+      compress_queue_(new ThreadSafeQueue<Block *>()),
+      enable_thread_write_(true),
+      closed_(false),
+      num_records_(0),
+      num_bytes_(0) {
+  if (fd_ < 0) {
+    throw std::runtime_error("Failed to open log file " + path + ": " + strerror(errno));
+  }
+  if (compression_ != compression) {
+    std::cout << "Compression " << compression << " is not supported by this build" << std::endl;
+  }
+
+  // one block being filled, one being written, and one per compression thread in flight, at least
+  // one thread compresses, otherwise sealed blocks would never be picked up
+  const size_t num_threads =
+      (compression_ == kLogCompressionNone ? 0 : std::max<size_t>(1, num_threads_compression));
+  for (size_t i = 0; i < 2 + num_threads; ++i) {
+    blocks_.emplace_back(new Block());
+    blocks_.back()->data.resize(size_block_);
+    free_.push_back(blocks_.back().get());
+  }
+  active_ = free_.front();
+  free_.pop_front();
+  active_->state = BlockState::kFilling;
+  active_->header = LogBlockHeader();
+
+  LogFileHeader header;
+  header.magic = kMagicLogFile;
+  header.version = kVersionLog;
+  writeFile(&header, sizeof(header));
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    handle_threads_compress_.emplace_back(new std::thread(&LogWriter::threadCompress, this));
+  }
+  handle_thread_write_.reset(new std::thread(&LogWriter::threadWrite, this));
+}
+
+LogWriter::~LogWriter() { close(); }
+
+void LogWriter::write(const uint64_t timestamp, const std::string &channel, const void *data,
+                      const size_t size, const bool shared_memory) {
+  const size_t len_record = sizeof(LogRecordHeader) + channel.size() + size;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (closed_) {
+    return;
+  }
+
+  if (active_->len_data > 0 && active_->len_data + len_record > size_block_) {
+    sealBlock(&lock);
+  }
+
+  auto &block = *active_;
+  // a record larger than block occupies a block on its own
+  if (block.data.size() < len_record) {
+    block.data.resize(len_record);
+  }
+  block.channels.insert(channelId(channel));
+
+  LogRecordHeader header;
+  header.timestamp = timestamp;
+  header.len_channel = channel.size();
+  header.len_data = size;
+  header.flags = (shared_memory ? kLogRecordSharedMemory : 0);
+  header.reserved = 0;
+
+  auto p = block.data.data() + block.len_data;
+  memcpy(p, &header, sizeof(header));
+  memcpy(p + sizeof(header), channel.data(), channel.size());
+  copy(p + sizeof(header) + channel.size(), data, size);
+  block.len_data += len_record;
+
+  if (block.header.num_records++ == 0) {
+    block.header.t_first = timestamp;
+  }
+  block.header.t_last = timestamp;
+  num_records_.fetch_add(1);
+}
+
+void LogWriter::writeBlock(const LogBlockHeader &header, const void *data,
+                           const std::vector<std::string> &channels) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (closed_) {
+    return;
+  }
+
+  // keep order of records appended before
+  if (active_->len_data > 0) {
+    sealBlock(&lock);
+  }
+
+  auto &block = *active_;
+  block.stored.resize(header.len_data);
+  memcpy(block.stored.data(), data, header.len_data);
+  block.is_stored = true;
+  block.header = header;
+  for (const auto &channel : channels) {
+    block.channels.insert(channelId(channel));
+  }
+  block.state = BlockState::kReady;
+  num_records_.fetch_add(header.num_records);
+
+  sealBlock(&lock);
+}
+
+void LogWriter::close() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+
+    if (active_->len_data > 0) {
+      sealBlock(&lock);
+    }
+    enable_thread_write_ = false;
+    cv_.notify_all();
+  }
+
+  if (handle_thread_write_) {
+    handle_thread_write_->join();
+    handle_thread_write_.reset();
+  }
+
+  compress_queue_->breakAllWait();
+  for (auto &handle : handle_threads_compress_) {
+    handle->join();
+  }
+  handle_threads_compress_.clear();
+
+  try {
+    // index
+    std::vector<uint8_t> index;
+    auto append = [&index](const void *data, const size_t size) {
+      index.insert(index.end(), reinterpret_cast<const uint8_t *>(data),
+                   reinterpret_cast<const uint8_t *>(data) + size);
+    };
+
+    const uint32_t num_channels = channel_names_.size();
+    append(&num_channels, sizeof(num_channels));
+    for (const auto &name : channel_names_) {
+      const uint32_t len = name.size();
+      append(&len, sizeof(len));
+      append(name.data(), name.size());
+    }
+
+    const uint32_t num_blocks = index_.size();
+    append(&num_blocks, sizeof(num_blocks));
+    for (const auto &entry : index_) {
+      append(&entry.first, sizeof(entry.first));
+      append(entry.second.data(), entry.second.size() * sizeof(uint32_t));
+    }
+
+    LogFooter footer;
+    footer.offset_index = offset_;
+    footer.len_index = index.size();
+    footer.magic = kMagicLogFooter;
+    footer.version = kVersionLog;
+
+    writeFile(index.data(), index.size());
+    writeFile(&footer, sizeof(footer));
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+  }
+
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void LogWriter::sealBlock(std::unique_lock<std::mutex> *lock) {
+  auto block = active_;
+  if (block->state == BlockState::kFilling) {
+    block->header.magic = kMagicLogBlock;
+    block->header.compression = kLogCompressionNone;
+    block->header.reserved = 0;
+    block->header.len_data = block->len_data;
+    block->header.len_raw = block->len_data;
+    block->is_stored = false;
+
+    if (compression_ == kLogCompressionNone) {
+      block->state = BlockState::kReady;
+    } else {
+      block->state = BlockState::kSealed;
+      compress_queue_->enqueue(block);
+    }
+  }
+  sealed_.push_back(block);
+  cv_.notify_all();
+
+  // wait for writer thread to release a block
+  cv_.wait(*lock, [this]() { return !free_.empty(); });
+  active_ = free_.front();
+  free_.pop_front();
+  active_->state = BlockState::kFilling;
+  active_->len_data = 0;
+  active_->is_stored = false;
+  active_->header = LogBlockHeader();
+  active_->channels.clear();
+}
+
+uint32_t LogWriter::channelId(const std::string &channel) {
+  auto it = channels_.find(channel);
+  if (it == channels_.end()) {
+    it = channels_.emplace(channel, static_cast<uint32_t>(channel_names_.size())).first;
+    channel_names_.push_back(channel);
+  }
+  return it->second;
+}
+
+void LogWriter::threadWrite() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    // a sealed block not picked up by compression threads yet is written as is, when write() is
+    // about to wait for a free block, so that compression never stalls recording
+    cv_.wait(lock, [this]() {
+      return (sealed_.empty() && !enable_thread_write_) ||
+             (!sealed_.empty() && (sealed_.front()->state == BlockState::kReady ||
+                                   (sealed_.front()->state == BlockState::kSealed && free_.empty())));
+    });
+    if (sealed_.empty()) {
+      break;
+    }
+
+    auto block = sealed_.front();
+    sealed_.pop_front();
+    block->state = BlockState::kReady;
+    lock.unlock();
+
+    std::pair<LogBlockIndex, std::vector<uint32_t>> entry;
+    entry.first.offset = offset_;
+    entry.first.t_first = block->header.t_first;
+    entry.first.t_last = block->header.t_last;
+    entry.first.num_records = block->header.num_records;
+    entry.first.num_channels = block->channels.size();
+    entry.second.assign(block->channels.begin(), block->channels.end());
+
+    try {
+      writeFile(&block->header, sizeof(block->header));
+      writeFile(block->is_stored ? block->stored.data() : block->data.data(),
+                block->header.len_data);
+      index_.push_back(std::move(entry));
+    } catch (std::exception &e) {
+      std::cout << e.what() << std::endl;
+    }
+
+    // shrink oversized buffer back to block size
+    if (block->data.size() > size_block_) {
+      block->data.resize(size_block_);
+      block->data.shrink_to_fit();
+    }
+
+    lock.lock();
+    block->state = BlockState::kFree;
+    free_.push_back(block);
+    cv_.notify_all();
+  }
+}
+
+void LogWriter::threadCompress() {
+  while (true) {
+    Block *block;
+    if (!compress_queue_->waitDequeue(&block)) {
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // block may be written as is by writer thread already
+      if (block->state != BlockState::kSealed) {
+        continue;
+      }
+      block->state = BlockState::kCompressing;
+    }
+
+    const auto len = logCompress(compression_, block->data.data(), block->len_data, &block->stored);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // keep records as is if compression does not help
+    if (len > 0 && len < block->len_data) {
+      block->header.compression = compression_;
+      block->header.len_data = len;
+      block->is_stored = true;
+    }
+    block->state = BlockState::kReady;
+    cv_.notify_all();
+  }
+}
+
+void LogWriter::writeFile(const void *data, const size_t size) {
+  auto p = reinterpret_cast<const uint8_t *>(data);
+  size_t len_written = 0;
+  while (len_written < size) {
+    auto ret = ::write(fd_, p + len_written, size - len_written);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::string("Failed to write log file: ") + strerror(errno));
+    }
+    len_written += ret;
+  }
+  offset_ += size;
+  num_bytes_.fetch_add(size);
+}
+
+}  // namespace shame
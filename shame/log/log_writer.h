@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "shame/log/log.h"
+
+namespace shame {
+
+template <typename T>
+class ThreadSafeQueue;
+
+class LogWriter {
+ public:
+  /**
+   * @brief constructor of LogWriter, create or truncate log file, throws on fail
+   * @param path path of log file
+   * @param size_block size of block in bytes, also the granularity of disk writes
+   * @param compression compression of blocks, kLogCompressionXXX
+   * @param num_threads_compression number of threads compressing blocks, at least 1 if compressing
+   */
+  LogWriter(const std::string &path, const size_t size_block = 16 * 1024 * 1024,
+            const uint32_t compression = kLogCompressionNone,
+            const size_t num_threads_compression = 2);
+
+  /**
+   * @brief destructor, close log if not closed yet
+   */
+  ~LogWriter();
+
+ public:
+  /**
+   * @brief append a record, blocks only while all buffers are pending
+   * @param timestamp timestamp in microseconds
+   * @param channel channel name
+   * @param data pointer to data
+   * @param size length of data in bytes
+   * @param shared_memory whether the message was received via shared memory
+   */
+  void write(const uint64_t timestamp, const std::string &channel, const void *data,
+             const size_t size, const bool shared_memory);
+
+  /**
+   * @brief append a stored block as is, without decompressing or compressing
+   * @param header header of block
+   * @param data pointer to stored data of block
+   * @param channels names of channels in block
+   */
+  void writeBlock(const LogBlockHeader &header, const void *data,
+                  const std::vector<std::string> &channels);
+
+  /**
+   * @brief flush pending records, write index and footer, and close log file
+   */
+  void close();
+
+  /**
+   * @brief get number of records appended
+   */
+  uint64_t numRecords() const { return num_records_.load(); }
+
+  /**
+   * @brief get number of bytes written to log file
+   */
+  uint64_t numBytes() const { return num_bytes_.load(); }
+
+ protected:
+  enum class BlockState { kFree, kFilling, kSealed, kCompressing, kReady };
+
+  struct Block {
+    // records
+    std::vector<uint8_t> data;
+    size_t len_data = 0;
+    // records to be written, compressed or copied by writeBlock()
+    std::vector<uint8_t> stored;
+    bool is_stored = false;
+    LogBlockHeader header;
+    std::set<uint32_t> channels;
+    BlockState state = BlockState::kFree;
+  };
+
+  /**
+   * @brief inner thread to write blocks to disk in order
+   */
+  void threadWrite();
+
+  /**
+   * @brief inner thread to compress sealed blocks
+   */
+  void threadCompress();
+
+  /**
+   * @brief seal active block and take a free one, caller holds mutex_
+   */
+  void sealBlock(std::unique_lock<std::mutex> *lock);
+
+  /**
+   * @brief get id of channel, caller holds mutex_
+   */
+  uint32_t channelId(const std::string &channel);
+
+  /**
+   * @brief inner function to write bytes to log file, throws on fail
+   */
+  void writeFile(const void *data, const size_t size);
+
+ protected:
+  const size_t size_block_;
+  const uint32_t compression_;
+  int fd_;
+  uint64_t offset_;
+
+  // blocks are filled by write() one at a time, compressed in parallel and written in order
+  std::vector<std::unique_ptr<Block>> blocks_;
+  Block *active_;
+  std::deque<Block *> free_;
+  std::deque<Block *> sealed_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+  std::unordered_map<std::string, uint32_t> channels_;
+  std::vector<std::string> channel_names_;
+  std::vector<std::pair<LogBlockIndex, std::vector<uint32_t>>> index_;
+
+  std::shared_ptr<ThreadSafeQueue<Block *>> compress_queue_;
+  std::vector<std::shared_ptr<std::thread>> handle_threads_compress_;
+  std::shared_ptr<std::thread> handle_thread_write_;
+  bool enable_thread_write_;
+  bool closed_;
+
+  std::atomic<uint64_t> num_records_;
+  std::atomic<uint64_t> num_bytes_;
+};
+
+}  // namespace shame
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include "shame/publisher.h"
+#include <iostream>
+#include "shame/shm/shm.h"
+#include "shame/udpm/udpm.h"
+
+namespace shame {
+
+RawPublisher::RawPublisher(Shame &shame, const std::string &channel, const bool shared_memory)
+    : udpm_(shame.udpm_),
+      shm_(shame.shm_),
+      channel_(channel),
+      shared_memory_(shared_memory),
+      publication_(nullptr),
+      shame_data_(nullptr) {
+  // resolved like any publishing by name, but kept here so that the instance is not needed later
+  auto interned = shame.intern(channel);
+  publication_ = shame.publication(interned);
+  if (shared_memory_) {
+    if (!shm_) {
+      std::cout << "This shame instance was not constructed with shared memory supported"
+                << std::endl;
+      return;
+    }
+
+    try {
+      shame_data_ = shame.shameData(interned);
+    } catch (std::exception &e) {
+      std::cout << "Failed to construct shared memory key: " << channel_ << std::endl;
+    }
+  }
+}
+
+bool RawPublisher::hasSubscribers() { return udpm_->hasSubscribers(publication_); }
+
+size_t RawPublisher::publish(const void *data, const size_t size) {
+  if (!hasSubscribers()) {
+    return 0;
+  }
+
+  if (!shared_memory_) {
+    return udpm_->send(publication_, data, size, false);
+  }
+
+  // failure reported on construction
+  if (!shame_data_) {
+    return 0;
+  }
+
+  size_t size_sent = 0;
+  try {
+    size_sent = shm_->put(shame_data_, data, size);
+  } catch (std::exception &e) {
+    std::cout << "Failed to put data to shared memory key: " << channel_ << std::endl;
+    return 0;
+  }
+  return sendKey(size_sent, false);
+}
+
+size_t RawPublisher::publishMessage(const google::protobuf::MessageLite &msg) {
+  if (!hasSubscribers()) {
+    return 0;
+  }
+
+  if (!shared_memory_) {
+    msg.SerializeToString(&buffer_);
+    return udpm_->send(publication_, buffer_.data(), buffer_.size(), false);
+  }
+
+  if (!shame_data_) {
+    return 0;
+  }
+
+  size_t size = 0;
+  try {
+    size = shm_->put(shame_data_, msg);
+  } catch (std::exception &e) {
+    std::cout << "Failed to put data to shared memory key: " << channel_ << std::endl;
+    return 0;
+  }
+  return sendKey(size, false);
+}
+
+size_t RawPublisher::publishObject(const std::shared_ptr<const google::protobuf::MessageLite> &msg) {
+  if (!msg || !hasSubscribers()) {
+    return 0;
+  }
+
+  if (!shared_memory_) {
+    const bool delivered_locally = udpm_->sendLocal(publication_, msg, false);
+    msg->SerializeToString(&buffer_);
+    return udpm_->send(publication_, buffer_.data(), buffer_.size(), false, delivered_locally);
+  }
+
+  if (!shame_data_) {
+    return 0;
+  }
+
+  // the segment has to be filled before local subscribers fall back to it
+  size_t size = 0;
+  try {
+    size = shm_->put(shame_data_, *msg);
+  } catch (std::exception &e) {
+    std::cout << "Failed to put data to shared memory key: " << channel_ << std::endl;
+    return 0;
+  }
+  return sendKey(size, udpm_->sendLocal(publication_, msg, true));
+}
+
+size_t RawPublisher::sendKey(const size_t size, const bool delivered_locally) {
+  if (udpm_->send(publication_, channel_.data(), channel_.size(), true, delivered_locally) !=
+      channel_.size()) {
+    std::cout << "Sent unexpected length" << std::endl;
+    return 0;
+  }
+  return size;
+}
+
+}  // namespace shame
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <google/protobuf/message_lite.h>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include "shame/shame.h"
+
+namespace shame {
+
+struct Publication;
+
+class RawPublisher {
+ public:
+  /**
+   * @brief constructor of publisher, resolves channel and shared memory segment once, so that
+   * publishing does no lookup by name, not thread-safe
+   * @param shame instance to publish by, only needed during construction
+   * @param channel channel name
+   * @param shared_memory whether shared memory used
+   */
+  RawPublisher(Shame &shame, const std::string &channel, const bool shared_memory);
+
+ public:
+  /**
+   * @brief get channel name
+   */
+  const std::string &channel() const { return channel_; }
+
+  /**
+   * @brief tell whether the channel may have any subscriber, see Shame::hasSubscribers
+   */
+  bool hasSubscribers();
+
+  /**
+   * @brief publish raw data
+   * @param data pointer to data to be published
+   * @param size length of data in bytes to be published
+   * @return bytes published
+   */
+  size_t publish(const void *data, const size_t size);
+
+ protected:
+  /**
+   * @brief publish protobuf message, serialized into a buffer reused for every message
+   */
+  size_t publishMessage(const google::protobuf::MessageLite &msg);
+
+  /**
+   * @brief publish protobuf message object, see Shame::publish
+   */
+  size_t publishObject(const std::shared_ptr<const google::protobuf::MessageLite> &msg);
+
+  /**
+   * @brief send shared memory key, i.e. channel name, after segment is filled
+   */
+  size_t sendKey(const size_t size, const bool delivered_locally);
+
+ protected:
+  std::shared_ptr<Udpm> udpm_;
+  std::shared_ptr<Shm> shm_;
+  const std::string channel_;
+  const bool shared_memory_;
+  Publication *publication_;
+  ShameData *shame_data_;
+  std::string buffer_;
+};
+
+template <typename ProtoType,
+          typename std::enable_if<
+              std::is_base_of<google::protobuf::MessageLite, ProtoType>::value>::type * = nullptr>
+class Publisher : public RawPublisher {
+ public:
+  /**
+   * @brief constructor of protobuf publisher, see RawPublisher
+   */
+  Publisher(Shame &shame, const std::string &channel, const bool shared_memory)
+      : RawPublisher(shame, channel, shared_memory) {}
+
+ public:
+  /**
+   * @brief publish protobuf message
+   * @param msg protobuf message
+   * @return bytes published
+   */
+  size_t publish(const ProtoType &msg) { return publishMessage(msg); }
+
+  /**
+   * @brief publish protobuf message object, subscribers of the same type in process get the
+   * object itself, see Shame::publish
+   * @param msg protobuf message, must not be modified after publishing
+   * @return bytes published via transport
+   */
+  size_t publish(const std::shared_ptr<const ProtoType> &msg) { return publishObject(msg); }
+};
+
+}  // namespace shame
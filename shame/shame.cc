@@ -7,20 +7,39 @@
  */
 
 #include "shame/shame.h"
+#include <poll.h>
+#include <cstring>
+#include <exception>
 #include <iostream>
-#include <regex>
+#include "shame/common/hash.h"
+#include "shame/common/pattern.h"
 #include "shame/common/thread_safe_queue.h"
+#include "shame/common/time.h"
 #include "shame/shm/shm.h"
 #include "shame/udpm/udpm.h"
 
 namespace shame {
 
+static const size_t kCapacityMessageQueue = 1024;
+static const size_t kCapacityAsyncQueue = 1024;
+// messages fitting a single datagram go via udpm by default
+static const size_t kMinSizeSharedMemory = 64 * 1024;
+
+thread_local Shame *Shame::polling_ = nullptr;
+
 Shame::Shame(const std::string &multicast_addr, const uint16_t multicast_port, const int ttl,
              const std::string &name_shm)
-    : msg_queue_(
-          new ThreadSafeQueue<std::tuple<std::string, std::shared_ptr<uint8_t>, size_t, bool>>()) {
+    : min_size_shm_(kMinSizeSharedMemory),
+      subscriptions_(std::make_shared<Subscriptions>()),
+      generation_(1),
+      msg_queue_(new ThreadSafeQueue<Message>(kCapacityMessageQueue, OverflowPolicy::kDropOldest)),
+      enable_thread_dispatch_(false),
+      listener_(0),
+      num_polled_(0),
+      segment_(0) {
+  async_options_.capacity = kCapacityAsyncQueue;
   try {
-    udpm_.reset(new Udpm(multicast_addr, multicast_port, ttl));
+    udpm_ = Udpm::instance(multicast_addr, multicast_port, ttl);
   } catch (std::exception &e) {
     std::cout << "Failed to construct UDPM, you may not connected to any network. " << std::endl
               << "Try the following commands to setup local loopback:" << std::endl
@@ -31,11 +50,42 @@ Shame::Shame(const std::string &multicast_addr, const uint16_t multicast_port, c
 
   if (!name_shm.empty()) {
     try {
-      shm_.reset(new Shm(name_shm));
+      shm_ = Shm::instance(name_shm);
     } catch (std::exception &e) {
       std::cout << "Failed to open shared memory object: " << name_shm << std::endl;
       exit(1);
     }
+    // announced with channels published and subscribed, which the transport tells apart by
+    // instance
+    segment_ = channelId(name_shm);
+  }
+}
+
+Shame::~Shame() {
+  // pending messages of publishAsync are sent before exiting
+  {
+    std::lock_guard<std::mutex> lock(mutex_async_);
+    enable_thread_send_ = false;
+    cv_async_.notify_all();
+  }
+  for (auto handle : {&handle_thread_send_, &handle_thread_send_urgent_}) {
+    if (*handle) {
+      (*handle)->join();
+      handle->reset();
+    }
+  }
+
+  stopHandling();
+  if (listener_) {
+    udpm_->removeListener(listener_);
+  }
+
+  // transport may be shared with other instances
+  for (auto &items : *std::atomic_load(&subscriptions_)) {
+    for (auto &item : items.second) {
+      item->stopDelivering();
+      udpm_->leave(item->channel(), segment_);
+    }
   }
 }
 
@@ -45,26 +95,205 @@ void Shame::startHandling() {
   msg_queue_->reset();
 
   enable_thread_dispatch_.store(true);
-  handle_thread_dispatch_.reset(new std::thread(&Shame::threadDispatch, this));
+  handle_thread_dispatch_.reset(new std::thread(&Shame::threadDispatch, this, Lane::kNormal));
+  handle_thread_dispatch_urgent_.reset(new std::thread(&Shame::threadDispatch, this, Lane::kUrgent));
+  for (auto &items : *std::atomic_load(&subscriptions_)) {
+    for (auto &item : items.second) {
+      item->startDelivering();
+    }
+  }
 
-  udpm_->startAsyncReceiving(std::bind(&Shame::callbackReceive, this, std::placeholders::_1,
-                                       std::placeholders::_2, std::placeholders::_3,
-                                       std::placeholders::_4));
+  listen();
+  udpm_->startAsyncReceiving();
 }
 
 void Shame::stopHandling() {
-  udpm_->stopAsyncReceiving();
+  if (enable_thread_dispatch_.load()) {
+    udpm_->stopAsyncReceiving();
+    udpm_->removeListener(listener_);
+    listener_ = 0;
+  }
 
   enable_thread_dispatch_.store(false);
   msg_queue_->breakAllWait();
-  if (handle_thread_dispatch_) {
-    handle_thread_dispatch_->join();
-    handle_thread_dispatch_.reset();
+  for (auto handle : {&handle_thread_dispatch_, &handle_thread_dispatch_urgent_}) {
+    if (*handle) {
+      (*handle)->join();
+      handle->reset();
+    }
   }
+
+  // messages pending in subscriptions are left to poll
+  for (auto &items : *std::atomic_load(&subscriptions_)) {
+    for (auto &item : items.second) {
+      item->stopDelivering();
+    }
+  }
+}
+
+size_t Shame::poll(const size_t max_messages, const uint64_t timeout) {
+  if (enable_thread_dispatch_.load()) {
+    std::cout << "Polling is not allowed while handling" << std::endl;
+    return 0;
+  }
+  listen();
+  msg_queue_->reset();
+
+  // messages of this instance received on this thread are dispatched inline
+  struct Polling {
+    explicit Polling(Shame *shame) { polling_ = shame; }
+    ~Polling() { polling_ = nullptr; }
+  } polling(this);
+
+  const uint64_t deadline = nowMonotonic() + timeout;
+  num_polled_ = 0;
+  auto exhausted = [&]() {
+    return (max_messages > 0 && num_polled_ >= max_messages) ||
+           (timeout > 0 && num_polled_ > 0 && nowMonotonic() >= deadline);
+  };
+  auto deliverPending = [&]() {
+    for (auto &items : *std::atomic_load(&subscriptions_)) {
+      for (auto &item : items.second) {
+        if (!exhausted()) {
+          num_polled_ += item->deliverPending(max_messages > 0 ? max_messages - num_polled_ : 0);
+        }
+      }
+    }
+  };
+
+  // messages left in subscriptions by delivery policies come first
+  deliverPending();
+
+  Message msg;
+  while (!exhausted()) {
+    // messages queued by receiving threads of other instances sharing the transport, or published
+    // in process
+    if (msg_queue_->dequeue(&msg)) {
+      dispatch(msg);
+      continue;
+    }
+    if (udpm_->receive(1) > 0) {
+      continue;
+    }
+
+    // wait for the first message only
+    const auto t = nowMonotonic();
+    if (num_polled_ > 0 || t >= deadline) {
+      break;
+    }
+    if (udpm_->receivingAsync()) {
+      if (msg_queue_->waitDequeueFor(&msg, std::chrono::microseconds(deadline - t))) {
+        dispatch(msg);
+      }
+    } else {
+      pollfd fds{udpm_->fd(), POLLIN, 0};
+      const int timeout_ms = static_cast<int>((deadline - t + 999) / 1000);
+      if (::poll(&fds, 1, timeout_ms) <= 0) {
+        break;
+      }
+    }
+  }
+
+  // messages delivered to subscriptions with delivery policies while receiving
+  deliverPending();
+
+  return num_polled_;
+}
+
+int Shame::fd() { return udpm_->fd(); }
+
+Publication *Shame::publication(Channel *channel) {
+  Publication *publication = channel->publication.load();
+  if (!publication) {
+    publication = udpm_->publication(channel->name, segment_);
+    channel->publication.store(publication);
+  }
+  return publication;
+}
+
+ShameData *Shame::shameData(Channel *channel) {
+  ShameData *shame_data = channel->shame_data.load();
+  if (!shame_data) {
+    // TODO(Hongxin): generate random unique key from channel
+    shame_data = shm_->find_or_construct(channel->name);
+    channel->shame_data.store(shame_data);
+  }
+  return shame_data;
+}
+
+bool Shame::hasSubscribers(const std::string &channel) {
+  return udpm_->hasSubscribers(publication(intern(channel)));
 }
 
 size_t Shame::publish(const std::string &channel, const void *data, const size_t size,
                       const bool shared_memory) {
+  return publish(intern(channel), data, size, shared_memory);
+}
+
+size_t Shame::publish(Channel *channel, const void *data, const size_t size,
+                      const bool shared_memory) {
+  if (shared_memory) {
+    return publishShm(channel, nullptr, 0, data, size);
+  }
+
+  auto publication = this->publication(channel);
+  if (!udpm_->hasSubscribers(publication)) {
+    return 0;
+  }
+  return udpm_->send(publication, data, size, false);
+}
+
+size_t Shame::publishShm(Channel *channel, const void *prefix, const size_t size_prefix,
+                         const void *data, const size_t size) {
+  if (!shm_) {
+    std::cout << "This shame instance was not constructed with shared memory supported"
+              << std::endl;
+    return 0;
+  }
+
+  auto publication = this->publication(channel);
+  if (!udpm_->hasSubscribers(publication)) {
+    return 0;
+  }
+
+  const std::string &key = channel->name;
+  size_t size_sent = 0;
+  try {
+    ShameData *shame_data = shameData(channel);
+    size_sent = (size_prefix == 0 ? shm_->put(shame_data, data, size)
+                                  : shm_->put(shame_data, prefix, size_prefix, data, size));
+  } catch (std::exception &e) {
+    std::cout << "Failed to put data to shared memory key: " << key << std::endl;
+    return 0;
+  }
+
+  // send shared memory key via udpm
+  if (udpm_->send(publication, key.data(), key.size(), true) != key.size()) {
+    std::cout << "Sent unexpected length" << std::endl;
+    return 0;
+  }
+
+  return size_sent;
+}
+
+size_t Shame::publish(const std::string &channel, const std::string &data,
+                      const bool shared_memory) {
+  return publish(intern(channel), (const void *)data.data(), data.size(), shared_memory);
+}
+
+size_t Shame::publish(const std::string &channel, const google::protobuf::MessageLite &msg,
+                      const bool shared_memory) {
+  return publish(intern(channel), msg, shared_memory);
+}
+
+size_t Shame::publish(Channel *channel, const google::protobuf::MessageLite &msg,
+                      const bool shared_memory) {
+  // nothing serialized for nobody
+  auto publication = this->publication(channel);
+  if (!udpm_->hasSubscribers(publication)) {
+    return 0;
+  }
+
   if (shared_memory) {
     if (!shm_) {
       std::cout << "This shame instance was not constructed with shared memory supported"
@@ -72,37 +301,41 @@ size_t Shame::publish(const std::string &channel, const void *data, const size_t
       return 0;
     }
 
-    // TODO(Hongxin): generate random unique key from channel
-    const std::string key(channel);
-
-    // put data to shared memory
-    size_t size_sent = 0;
+    const std::string &key = channel->name;
+    size_t size;
     try {
-      size_sent = shm_->put(key, data, size);
+      size = shm_->put(shameData(channel), msg);
     } catch (std::exception &e) {
       std::cout << "Failed to put data to shared memory key: " << key << std::endl;
       return 0;
     }
 
     // send shared memory key via udpm
-    if (udpm_->send(channel, key.data(), key.size(), true) != key.size()) {
+    if (udpm_->send(publication, key.data(), key.size(), true) != key.size()) {
       std::cout << "Sent unexpected length" << std::endl;
       return 0;
     }
 
-    return size_sent;
+    return size;
   } else {
-    return udpm_->send(channel, data, size, false);
+    std::string msg_str;
+    msg.SerializeToString(&msg_str);
+    return udpm_->send(publication, msg_str.data(), msg_str.size(), false);
   }
 }
 
-size_t Shame::publish(const std::string &channel, const std::string &data,
+size_t Shame::publish(const std::string &channel,
+                      const std::shared_ptr<const google::protobuf::MessageLite> &msg,
                       const bool shared_memory) {
-  return publish(channel, (const void *)data.data(), data.size(), shared_memory);
-}
+  if (!msg) {
+    return 0;
+  }
+  Channel *interned = intern(channel);
+  auto publication = this->publication(interned);
+  if (!udpm_->hasSubscribers(publication)) {
+    return 0;
+  }
 
-size_t Shame::publish(const std::string &channel, const google::protobuf::MessageLite &msg,
-                      const bool shared_memory) {
   if (shared_memory) {
     if (!shm_) {
       std::cout << "This shame instance was not constructed with shared memory supported"
@@ -110,93 +343,445 @@ size_t Shame::publish(const std::string &channel, const google::protobuf::Messag
       return 0;
     }
 
-    // TODO(Hongxin): generate random unique key from channel
-    const std::string key(channel);
-
+    // the segment has to be filled before local subscribers fall back to it
+    const std::string &key = interned->name;
     size_t size;
     try {
-      size = shm_->put(key, msg);
+      size = shm_->put(shameData(interned), *msg);
     } catch (std::exception &e) {
       std::cout << "Failed to put data to shared memory key: " << key << std::endl;
       return 0;
     }
 
-    // send shared memory key via udpm
-    if (udpm_->send(channel, key.data(), key.size(), true) != key.size()) {
+    const bool delivered_locally = udpm_->sendLocal(publication, msg, true);
+    if (udpm_->send(publication, key.data(), key.size(), true, delivered_locally) != key.size()) {
       std::cout << "Sent unexpected length" << std::endl;
       return 0;
     }
 
     return size;
-  } else {
+  }
+
+  const bool delivered_locally = udpm_->sendLocal(publication, msg, false);
+  std::string msg_str;
+  msg->SerializeToString(&msg_str);
+  return udpm_->send(publication, msg_str.data(), msg_str.size(), false, delivered_locally);
+}
+
+size_t Shame::publish(const std::string &channel, const std::string &data) {
+  Channel *interned = intern(channel);
+  auto publication = this->publication(interned);
+  bool shared_memory;
+  bool mirrored;
+  chooseTransport(publication, data.size(), &shared_memory, &mirrored);
+  if (mirrored) {
+    udpm_->send(publication, data.data(), data.size(), false, false, true);
+  }
+  return publish(interned, (const void *)data.data(), data.size(), shared_memory);
+}
+
+size_t Shame::publish(const std::string &channel, const google::protobuf::MessageLite &msg) {
+  Channel *interned = intern(channel);
+  auto publication = this->publication(interned);
+  bool shared_memory;
+  bool mirrored;
+  chooseTransport(publication, msg.ByteSizeLong(), &shared_memory, &mirrored);
+  if (!shared_memory) {
+    return publish(interned, msg, false);
+  }
+
+  if (mirrored) {
     std::string msg_str;
     msg.SerializeToString(&msg_str);
-    return publish(channel, msg_str.data(), msg_str.size(), false);
+    udpm_->send(publication, msg_str.data(), msg_str.size(), false, false, true);
+  }
+  return publish(interned, msg, true);
+}
+
+void Shame::setAutoTransport(const size_t min_size_shared_memory) {
+  min_size_shm_.store(min_size_shared_memory);
+}
+
+void Shame::chooseTransport(Publication *publication, const size_t size, bool *shared_memory,
+                            bool *mirrored) {
+  *shared_memory = false;
+  *mirrored = false;
+  if (!shm_ || size < min_size_shm_.load()) {
+    return;
+  }
+
+  // receivers on this host sharing the segment drop the udpm copy of a mirrored message
+  const auto audience = udpm_->audience(publication);
+  *shared_memory = audience.local_shm;
+  *mirrored = audience.local_shm && audience.others;
+}
+
+std::future<size_t> Shame::publishAsync(const std::string &channel, std::string &&data,
+                                        const bool shared_memory) {
+  auto buffer = std::make_shared<std::string>(std::move(data));
+  return enqueueAsync(channel, [this, channel, buffer, shared_memory]() {
+    return publish(channel, *buffer, shared_memory);
+  });
+}
+
+std::future<size_t> Shame::publishAsync(const std::string &channel,
+                                        const std::shared_ptr<const uint8_t> &data,
+                                        const size_t size, const bool shared_memory) {
+  return enqueueAsync(channel, [this, channel, data, size, shared_memory]() {
+    return publish(channel, data.get(), size, shared_memory);
+  });
+}
+
+std::future<size_t> Shame::publishAsync(
+    const std::string &channel, const std::shared_ptr<const google::protobuf::MessageLite> &msg,
+    const bool shared_memory) {
+  return enqueueAsync(channel, [this, channel, msg, shared_memory]() {
+    return publish(channel, msg, shared_memory);
+  });
+}
+
+void Shame::setPriority(const std::string &channel, const int priority) {
+  udpm_->setUrgent(channel, priority > 0);
+  std::lock_guard<std::mutex> lock(mutex_async_);
+  priorities_[channel] = priority;
+}
+
+std::future<size_t> Shame::enqueueAsync(const std::string &channel,
+                                        const std::function<size_t()> &task) {
+  AsyncMessage msg;
+  msg.task = task;
+  auto future = msg.promise.get_future();
+
+  std::unique_lock<std::mutex> lock(mutex_async_);
+  if (!enable_thread_send_) {
+    enable_thread_send_ = true;
+    handle_thread_send_.reset(new std::thread(&Shame::threadSend, this, false));
+    handle_thread_send_urgent_.reset(new std::thread(&Shame::threadSend, this, true));
+  }
+
+  auto it = priorities_.find(channel);
+  const int priority = (it == priorities_.end() ? 0 : it->second);
+  const bool urgent = priority > 0;
+  const size_t capacity = async_options_.capacity;
+  if (capacity > 0 && async_options_.policy == OverflowPolicy::kBlock) {
+    // capacity may be lifted to unlimited while waiting
+    cv_async_not_full_.wait(lock, [&]() {
+      return async_options_.capacity == 0 || num_async_[urgent] < async_options_.capacity;
+    });
+  } else if (capacity > 0 && num_async_[urgent] >= capacity) {
+    ++num_async_dropped_;
+    if (async_options_.policy == OverflowPolicy::kDropNewest) {
+      msg.promise.set_value(0);
+      return future;
+    }
+    // lanes are contiguous in order, urgent first, and the last of a lane has the lowest priority
+    auto last = (urgent ? std::prev(async_queue_.lower_bound(std::make_pair(0, 0)))
+                        : std::prev(async_queue_.end()));
+    auto oldest = async_queue_.lower_bound(std::make_pair(last->first.first, 0));
+    oldest->second.promise.set_value(0);
+    async_queue_.erase(oldest);
+    --num_async_[urgent];
   }
+
+  async_queue_.emplace(std::make_pair(-priority, seq_async_++), std::move(msg));
+  ++num_async_[urgent];
+  cv_async_.notify_all();
+  return future;
+}
+
+void Shame::setAsyncQueueOptions(const QueueOptions &options) {
+  std::lock_guard<std::mutex> lock(mutex_async_);
+  async_options_ = options;
+  cv_async_not_full_.notify_all();
+}
+
+void Shame::threadSend(const bool urgent) {
+  // messages of urgent channels are ordered first by their negative priority
+  auto next = [this, urgent]() {
+    auto it = (urgent ? async_queue_.begin() : async_queue_.lower_bound(std::make_pair(0, 0)));
+    return ((it == async_queue_.end() || (urgent && it->first.first >= 0)) ? async_queue_.end()
+                                                                            : it);
+  };
+
+  std::unique_lock<std::mutex> lock(mutex_async_);
+  while (true) {
+    cv_async_.wait(lock, [&]() { return !enable_thread_send_ || next() != async_queue_.end(); });
+    auto it = next();
+    if (it == async_queue_.end()) {
+      break;
+    }
+
+    auto msg = std::move(it->second);
+    --num_async_[it->first.first < 0];
+    async_queue_.erase(it);
+    cv_async_not_full_.notify_all();
+    lock.unlock();
+    // failures of sending, e.g. thrown by socket, are handed to the publisher via its future
+    try {
+      msg.promise.set_value(msg.task());
+    } catch (...) {
+      msg.promise.set_exception(std::current_exception());
+    }
+    lock.lock();
+  }
+}
+
+void Shame::enableBatching(const size_t max_len_batch, const uint64_t max_delay) {
+  udpm_->enableBatching(max_len_batch, max_delay);
+}
+
+void Shame::disableBatching() { udpm_->disableBatching(); }
+
+void Shame::setChannelGroups(const size_t num_groups) { udpm_->setGroups(num_groups); }
+
+void Shame::mapChannelToGroup(const std::string &channel, const std::string &multicast_addr) {
+  udpm_->mapChannel(channel, multicast_addr);
 }
 
 Subscription *Shame::subscribe(
     const std::string &channel,
     const std::function<void(const std::string &channel, const std::shared_ptr<uint8_t>&, const size_t)>
         &callback_udpm,
-    const std::function<void(const std::string &channel, const ShameData *)> &callback_shm) {
-  auto subscription = std::make_shared<RawSubscription>(channel, callback_udpm, callback_shm);
-  subscriptions_[channel].push_back(subscription);
+    const std::function<void(const std::string &channel, const ShameData *)> &callback_shm,
+    const DeliveryPolicy policy, const size_t depth) {
+  auto subscription =
+      std::make_shared<RawSubscription>(channel, callback_udpm, callback_shm, policy, depth);
+  addSubscription(subscription);
   return subscription.get();
 }
 
+void Shame::listen() {
+  if (!listener_) {
+    listener_ = udpm_->addListener(
+        std::bind(&Shame::callbackReceive, this, std::placeholders::_1, std::placeholders::_2,
+                  std::placeholders::_3, std::placeholders::_4, std::placeholders::_5),
+        std::bind(&Shame::callbackLocal, this, std::placeholders::_1, std::placeholders::_2,
+                  std::placeholders::_3, std::placeholders::_4),
+        segment_);
+  }
+}
+
+void Shame::addSubscription(const std::shared_ptr<Subscription> &subscription) {
+  if (enable_thread_dispatch_.load()) {
+    subscription->startDelivering();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_subscriptions_);
+    auto subscriptions = std::make_shared<Subscriptions>(*subscriptions_);
+    (*subscriptions)[subscription->channel()].push_back(subscription);
+    std::atomic_store(&subscriptions_, std::shared_ptr<const Subscriptions>(subscriptions));
+    generation_.fetch_add(1);
+  }
+  udpm_->join(subscription->channel(), segment_);
+}
+
 bool Shame::unsubscribe(Subscription *subscription) {
   if (!subscription) {
     return false;
   }
 
-  auto items = subscriptions_.find(subscription->channel());
-  if (items != subscriptions_.end()) {
+  std::shared_ptr<Subscription> removed;
+  {
+    std::lock_guard<std::mutex> lock(mutex_subscriptions_);
+    auto subscriptions = std::make_shared<Subscriptions>(*subscriptions_);
+    auto items = subscriptions->find(subscription->channel());
+    if (items == subscriptions->end()) {
+      return false;
+    }
     for (auto it = items->second.begin(); it != items->second.end(); ++it) {
       if (it->get() == subscription) {
+        removed = *it;
         items->second.erase(it);
-        return true;
+        break;
       }
     }
+    if (!removed) {
+      return false;
+    }
+    if (items->second.empty()) {
+      subscriptions->erase(items);
+    }
+    std::atomic_store(&subscriptions_, std::shared_ptr<const Subscriptions>(subscriptions));
+    generation_.fetch_add(1);
+
+    // must not be destroyed on its own delivering thread
+    if (removed->invoking()) {
+      retired_.push_back(removed);
+    }
+  }
+
+  // dispatch may still hold the previous snapshot, wait for callbacks in progress
+  removed->deactivate();
+  udpm_->leave(removed->channel(), segment_);
+  return true;
+}
+
+std::unordered_map<std::string, ChannelStatistics> Shame::statistics() const {
+  return udpm_->statistics();
+}
+
+void Shame::setQueueOptions(const QueueOptions &packets, const QueueOptions &messages,
+                            const size_t max_incomplete_messages) {
+  udpm_->setQueueOptions(packets, max_incomplete_messages);
+  msg_queue_->setOptions(messages);
+}
+
+std::unordered_map<std::string, QueueStatistics> Shame::queueStatistics() {
+  std::unordered_map<std::string, QueueStatistics> statistics;
+  statistics["packets"] = udpm_->packetQueueStatistics();
+  statistics["reassembly"] = udpm_->reassemblyStatistics();
+  statistics["messages"] = msg_queue_->statistics();
+  {
+    std::lock_guard<std::mutex> lock(mutex_async_);
+    statistics["async"].size = async_queue_.size();
+    statistics["async"].capacity = async_options_.capacity;
+    statistics["async"].num_dropped = num_async_dropped_;
+  }
+  statistics["unresolved"].num_dropped = udpm_->numUnresolved();
+  return statistics;
+}
+
+bool Shame::keepingUp(const std::string &channel) {
+  if (udpm_->congested() || msg_queue_->congested()) {
+    return false;
   }
 
-  return false;
+  Channel *interned = intern(channel);
+  std::lock_guard<std::mutex> lock(interned->mutex_keeping_up);
+  for (auto item : match(*interned, &interned->matched_keeping_up)) {
+    if (item->congested()) {
+      return false;
+    }
+  }
+
+  return true;
 }
 
 void Shame::callbackReceive(const std::string &channel, const std::shared_ptr<uint8_t> &data, const size_t size,
-                            const bool shared_memory) {
-  msg_queue_->enqueue(std::make_tuple(channel, data, size, shared_memory));
+                            const bool shared_memory, const bool urgent) {
+  if (polling_ == this) {
+    dispatch({intern(channel), data, size, shared_memory, nullptr, urgent});
+  } else {
+    msg_queue_->enqueue({intern(channel), data, size, shared_memory, nullptr, urgent}, urgent);
+  }
+}
+
+void Shame::callbackLocal(const std::string &channel,
+                          const std::shared_ptr<const google::protobuf::MessageLite> &object,
+                          const bool shared_memory, const bool urgent) {
+  // delivered on the same thread as messages via transport
+  msg_queue_->enqueue({intern(channel), nullptr, 0, shared_memory, object, urgent}, urgent);
+}
+
+Shame::Channel *Shame::intern(const std::string &name) {
+  {
+    // channels are interned once, so looking them up on every message shares the lock
+    std::shared_lock<std::shared_mutex> lock(mutex_channels_);
+    auto it = channels_.find(name);
+    if (it != channels_.end()) {
+      return it->second.get();
+    }
+  }
+
+  std::lock_guard<std::shared_mutex> lock(mutex_channels_);
+  auto it = channels_.find(name);
+  if (it == channels_.end()) {
+    std::unique_ptr<Channel> channel(new Channel);
+    channel->name = name;
+    it = channels_.emplace(name, std::move(channel)).first;
+  }
+  return it->second.get();
 }
 
-void Shame::threadDispatch() {
+const std::vector<Subscription *> &Shame::match(const Channel &channel, Matched *matched) {
+  const uint64_t generation = generation_.load();
+  if (matched->generation == generation) {
+    return matched->subscriptions;
+  }
+
+  matched->subscriptions.clear();
+  matched->snapshot = std::atomic_load(&subscriptions_);
+  for (auto &items : *matched->snapshot) {
+    if (matchesPattern(channel.name, items.first)) {
+      for (auto &item : items.second) {
+        matched->subscriptions.push_back(item.get());
+      }
+    }
+  }
+  matched->generation = generation;
+  return matched->subscriptions;
+}
+
+void Shame::threadDispatch(const Lane lane) {
   while (enable_thread_dispatch_.load()) {
-    std::tuple<std::string, std::shared_ptr<uint8_t>, size_t, bool> msg;
-    if (!msg_queue_->waitDequeue(&msg)) {
+    Message msg;
+    if (!msg_queue_->waitDequeue(&msg, lane)) {
       continue;
     }
+    dispatch(msg);
+  }
+}
 
-    // TODO(Hongxin): parallel dispatch
-    for (auto items : subscriptions_) {
-      std::regex pattern(items.first);
-      if (std::regex_match(std::get<0>(msg), pattern)) {
-        if (std::get<3>(msg)) {
-          const std::string key(reinterpret_cast<char *>(std::get<1>(msg).get()), std::get<2>(msg));
-          auto shame_data = shm_->find(key);
-          if (!shame_data) {
-            std::cout << "Failed to get data from shared memory key: " << key << std::endl;
-            return;
-          }
+void Shame::dispatch(const Message &msg) {
+  // serialized form of message object, for subscribers not accepting the object as is
+  std::shared_ptr<uint8_t> data = msg.data;
+  size_t size = msg.size;
+  const ShameData *shame_data = nullptr;
+
+  Channel *channel = msg.channel;
 
-          for (auto &item : items.second) {
-            item->callbackReceiveShm(std::get<0>(msg), shame_data);
+  // whether any callback was invoked right here, rather than messages left in subscriptions
+  bool invoked = false;
+
+  // TODO(Hongxin): parallel dispatch
+  for (auto item : match(*channel, &channel->matched[msg.urgent])) {
+    if (msg.object && item->deliverObject(channel->name, msg.object, msg.shared_memory, msg.urgent)) {
+      invoked = invoked || item->policy() == DeliveryPolicy::kKeepAll;
+      continue;
+    }
+
+    if (msg.shared_memory) {
+      // published in process by an instance with shared memory to one without
+      if (!shm_) {
+        continue;
+      }
+      if (!shame_data) {
+        // key is the channel name unless published by other implementations
+        const bool keyed_by_channel =
+            msg.object || (size == channel->name.size() &&
+                           memcmp(data.get(), channel->name.data(), size) == 0);
+        if (keyed_by_channel) {
+          shame_data = channel->shame_data.load();
+          if (!shame_data) {
+            auto found = shm_->find(channel->name);
+            channel->shame_data.store(found);
+            shame_data = found;
           }
         } else {
-          for (auto &item : items.second) {
-            item->callbackReceiveUdpm(std::get<0>(msg), std::get<1>(msg), std::get<2>(msg));
-          }
+          shame_data = shm_->find(std::string(reinterpret_cast<char *>(data.get()), size));
+        }
+        if (!shame_data) {
+          std::cout << "Failed to get data from shared memory of channel: " << channel->name
+                    << std::endl;
+          break;
         }
       }
+      item->deliverShm(channel->name, shame_data, msg.urgent);
+    } else {
+      if (!data) {
+        size = msg.object->ByteSizeLong();
+        data.reset(new uint8_t[size], std::default_delete<uint8_t[]>());
+        msg.object->SerializeToArray(data.get(), size);
+      }
+      item->deliverUdpm(channel->name, data, size, msg.urgent);
     }
+    invoked = invoked || item->policy() == DeliveryPolicy::kKeepAll;
+  }
+
+  // counted once per message, and by poll only, so that dispatch threads share no counter
+  if (invoked && polling_ == this) {
+    ++num_polled_;
   }
 }
 
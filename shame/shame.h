@@ -10,27 +10,39 @@
 
 #include <google/protobuf/message_lite.h>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
+#include <future>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <thread>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
+#include "shame/common/thread_safe_queue.h"
+#include "shame/statistics.h"
 #include "shame/subscription.h"
 
 namespace shame {
 
-template <typename T>
-class ThreadSafeQueue;
 class Udpm;
 class Shm;
+struct Publication;
 
 class Shame {
+  friend class RawPublisher;
+
  public:
   /**
-   * @brief constructor of Shame, throws on fail
+   * @brief constructor of Shame, throws on fail, instances of the same multicast group and shared
+   * memory in a process share a single transport, which receives and reassembles every packet once
+   * for all of them, and configurations of the transport like groups and batching apply to all of
+   * them
    * @param multicast_addr IP address of UDPM multicast
    * @param multicast_port port number of UDPM multicast
    * @param ttl ttl of UDP message
@@ -39,9 +51,14 @@ class Shame {
   Shame(const std::string &multicast_addr = "239.255.67.76", const uint16_t multicast_port = 6776,
         const int ttl = 0, const std::string &name_shm = "Shame");
 
+  /**
+   * @brief destructor, stop message handling
+   */
+  ~Shame();
+
  public:
   /**
-   * @brief start message handling
+   * @brief start message handling on internal threads
    */
   void startHandling();
 
@@ -50,6 +67,34 @@ class Shame {
    */
   void stopHandling();
 
+  /**
+   * @brief receive, reassemble and dispatch messages on the caller thread without any internal
+   * thread, must not be used while handling, callbacks of all subscriptions are invoked from here
+   * @param max_messages max number of messages dispatched, each counted once however many
+   * subscriptions it reaches, while those left in subscriptions by delivery policies count per
+   * subscription once delivered, 0 for unlimited
+   * @param timeout max time in microseconds to wait for the first message, and to spend on
+   * dispatching, 0 to only dispatch messages already pending without time limit
+   * @return number of messages dispatched
+   */
+  size_t poll(const size_t max_messages = 0, const uint64_t timeout = 0);
+
+  /**
+   * @brief get file descriptor to wait for in an event loop, readable when poll has messages to
+   * dispatch, unless another instance sharing the transport is handling
+   */
+  int fd();
+
+  /**
+   * @brief tell whether a channel may have any subscriber, so that building expensive messages
+   * nobody receives can be skipped, publishing to a channel without any returns 0 without copying
+   * or sending, subscribers in other instances are discovered once handling for two seconds since
+   * the channel was first published or checked, before which they are assumed
+   * @param channel channel name
+   * @return false only if known to have no subscriber
+   */
+  bool hasSubscribers(const std::string &channel);
+
   /**
    * @brief publish raw data
    * @param channel channel name
@@ -70,6 +115,23 @@ class Shame {
    */
   size_t publish(const std::string &channel, const std::string &data, const bool shared_memory);
 
+  /**
+   * @brief publish string by transport chosen from subscribers discovered, see setAutoTransport
+   * @param channel channel name
+   * @param data string to be published
+   * @return bytes published
+   */
+  size_t publish(const std::string &channel, const std::string &data);
+
+  /**
+   * @brief publish protobuf message by transport chosen from subscribers discovered, see
+   * setAutoTransport
+   * @param channel channel name
+   * @param msg protobuf message
+   * @return bytes published
+   */
+  size_t publish(const std::string &channel, const google::protobuf::MessageLite &msg);
+
   /**
    * @brief publish protobuf message
    * @param channel channel name
@@ -80,23 +142,158 @@ class Shame {
   size_t publish(const std::string &channel, const google::protobuf::MessageLite &msg,
                  const bool shared_memory);
 
+  /**
+   * @brief publish trivially copyable struct, written straight into shared memory, with its
+   * schema hash, see PodSchema
+   * @param channel channel name
+   * @param msg struct to be published
+   * @param shared_memory whether shared memory used
+   * @return bytes published
+   */
+  template <typename T,
+            typename std::enable_if<
+                !std::is_base_of<google::protobuf::MessageLite, T>::value &&
+                !std::is_pointer<T>::value && !std::is_convertible<const T &, std::string>::value &&
+                !std::is_convertible<const T &, std::shared_ptr<const google::protobuf::MessageLite>>::
+                    value>::type * = nullptr>
+  size_t publish(const std::string &channel, const T &msg, const bool shared_memory) {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+    static_assert(alignof(T) <= sizeof(PodHeader), "T must not be aligned to more than 16 bytes");
+    const PodHeader header{PodSchema<T>::hash(), static_cast<uint32_t>(sizeof(T)), 0};
+    if (shared_memory) {
+      const size_t size = publishShm(intern(channel), &header, sizeof(header), &msg, sizeof(T));
+      return size == sizeof(header) + sizeof(T) ? sizeof(T) : 0;
+    }
+
+    // fragments are cut from a single payload
+    struct {
+      PodHeader header;
+      T msg;
+    } pod{header, msg};
+    const size_t size = publish(channel, (const void *)&pod, sizeof(pod), false);
+    return size == sizeof(pod) ? sizeof(T) : 0;
+  }
+
+  /**
+   * @brief publish protobuf message object, subscribers of the same type in process get the
+   * object itself, without serialization or any copy for those subscribed by subscribeShared,
+   * while others get it via transport as usual
+   * @param channel channel name
+   * @param msg protobuf message, must not be modified after publishing
+   * @param shared_memory whether shared memory used
+   * @return bytes published via transport
+   */
+  size_t publish(const std::string &channel,
+                 const std::shared_ptr<const google::protobuf::MessageLite> &msg,
+                 const bool shared_memory);
+
+  /**
+   * @brief publish string on the sender thread, returns immediately
+   * @param channel channel name
+   * @param data string to be published, moved
+   * @param shared_memory whether shared memory used
+   * @return future of bytes published, or of the exception thrown on sending
+   */
+  std::future<size_t> publishAsync(const std::string &channel, std::string &&data,
+                                   const bool shared_memory);
+
+  /**
+   * @brief publish shared buffer on the sender thread, returns immediately, the buffer must not
+   * be modified until the future is ready
+   * @param channel channel name
+   * @param data buffer to be published
+   * @param size length of data in bytes to be published
+   * @param shared_memory whether shared memory used
+   * @return future of bytes published, or of the exception thrown on sending
+   */
+  std::future<size_t> publishAsync(const std::string &channel,
+                                   const std::shared_ptr<const uint8_t> &data, const size_t size,
+                                   const bool shared_memory);
+
+  /**
+   * @brief serialize and publish protobuf message on the sender thread, returns immediately, the
+   * message must not be modified until the future is ready
+   * @param channel channel name
+   * @param msg protobuf message
+   * @param shared_memory whether shared memory used
+   * @return future of bytes published, or of the exception thrown on sending
+   */
+  std::future<size_t> publishAsync(const std::string &channel,
+                                   const std::shared_ptr<const google::protobuf::MessageLite> &msg,
+                                   const bool shared_memory);
+
+  /**
+   * @brief set priority of channel for publishAsync, pending messages of higher priority are sent
+   * first, and messages of the same priority in order of publishing, channels of positive priority
+   * are urgent: their messages are sent on a thread of their own by publishAsync and without
+   * batching, and overtake messages of other channels on receivers, in queues of packets, of
+   * messages and of subscriptions, and are dispatched on a thread of their own while handling,
+   * so callbacks of DeliveryPolicy::kKeepAll subscribed to both urgent and other channels may run
+   * concurrently
+   * @param channel channel name
+   * @param priority priority, 0 by default
+   */
+  void setPriority(const std::string &channel, const int priority);
+
+  /**
+   * @brief set threshold of publishing without choosing transport: messages of this size or
+   * larger go via shared memory if there are subscribers on this host sharing the segment, and
+   * also via udpm if there are others as well, while smaller messages and messages without such
+   * subscribers go via udpm, subscribers are discovered while handling or polling only
+   * @param min_size_shared_memory min size in bytes of messages via shared memory
+   */
+  void setAutoTransport(const size_t min_size_shared_memory);
+
+  /**
+   * @brief enable coalescing of small udpm messages, possibly of different channels, into a single
+   * datagram, which is flushed when full or on deadline
+   * @param max_len_batch max length of batch datagram in bytes
+   * @param max_delay max delay in microseconds of a message waiting in batch
+   */
+  void enableBatching(const size_t max_len_batch = 8192, const uint64_t max_delay = 100);
+
+  /**
+   * @brief flush pending batch and disable coalescing of small udpm messages
+   */
+  void disableBatching();
+
+  /**
+   * @brief spread channels over multicast groups by hash of channel name, so that subscribers
+   * only receive groups of their channels, all peers have to use the same groups
+   * @param num_groups number of groups at consecutive addresses starting from multicast_addr
+   */
+  void setChannelGroups(const size_t num_groups);
+
+  /**
+   * @brief send a channel to the given multicast group, overriding the hashed one, all peers have
+   * to use the same mapping
+   * @param channel channel name
+   * @param multicast_addr IP address of UDPM multicast on multicast_port
+   */
+  void mapChannelToGroup(const std::string &channel, const std::string &multicast_addr);
+
   /**
    * @brief subscribe as raw data
    * @param channel channel name
    * @param callback_msg_udpm callback function on udpm message
    * @param callback_msg_shm callback function on shm message
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
    * @return handle of this subscription
    */
   Subscription *subscribe(
       const std::string &channel,
       const std::function<void(const std::string &channel, const std::shared_ptr<uint8_t>&, const size_t)>
           &callback_msg_udpm,
-      const std::function<void(const std::string &channel, const ShameData *)> &callback_msg_shm);
+      const std::function<void(const std::string &channel, const ShameData *)> &callback_msg_shm,
+      const DeliveryPolicy policy = DeliveryPolicy::kKeepAll, const size_t depth = 1);
 
   /**
    * @brief subscribe as protobuf message
    * @param channel channel name
    * @param callback_msg callback function on message
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
    * @return handle of this subscription
    */
   template <typename ProtoType,
@@ -104,9 +301,57 @@ class Shame {
                 std::is_base_of<google::protobuf::MessageLite, ProtoType>::value>::type * = nullptr>
   Subscription *subscribe(const std::string &channel,
                           const std::function<void(const std::string &, const std::shared_ptr<ProtoType>&,
-                                                   const bool)> &callback_msg) {
-    auto subscription = std::make_shared<ProtobufSubscription<ProtoType>>(channel, callback_msg);
-    subscriptions_[channel].push_back(subscription);
+                                                   const bool)> &callback_msg,
+                          const DeliveryPolicy policy = DeliveryPolicy::kKeepAll,
+                          const size_t depth = 1) {
+    auto subscription =
+        std::make_shared<ProtobufSubscription<ProtoType>>(channel, callback_msg, policy, depth);
+    addSubscription(subscription);
+    return subscription.get();
+  }
+
+  /**
+   * @brief subscribe as trivially copyable struct, read in place without any parsing or copy
+   * @param channel channel name
+   * @param callback_msg callback function on message, valid during callback only, publishers via
+   * shared memory wait for callbacks in progress
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
+   * @return handle of this subscription
+   */
+  template <typename T,
+            typename std::enable_if<!std::is_base_of<google::protobuf::MessageLite, T>::value>::type
+                * = nullptr>
+  Subscription *subscribe(const std::string &channel,
+                          const std::function<void(const std::string &, const T &, const bool)>
+                              &callback_msg,
+                          const DeliveryPolicy policy = DeliveryPolicy::kKeepAll,
+                          const size_t depth = 1) {
+    auto subscription = std::make_shared<PodSubscription<T>>(channel, callback_msg, policy, depth);
+    addSubscription(subscription);
+    return subscription.get();
+  }
+
+  /**
+   * @brief subscribe as read-only protobuf message shared by all subscribers, message objects
+   * published in process are delivered without copy
+   * @param channel channel name
+   * @param callback_msg callback function on message
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
+   * @return handle of this subscription
+   */
+  template <typename ProtoType,
+            typename std::enable_if<
+                std::is_base_of<google::protobuf::MessageLite, ProtoType>::value>::type * = nullptr>
+  Subscription *subscribeShared(
+      const std::string &channel,
+      const std::function<void(const std::string &, const std::shared_ptr<const ProtoType> &,
+                               const bool)> &callback_msg,
+      const DeliveryPolicy policy = DeliveryPolicy::kKeepAll, const size_t depth = 1) {
+    auto subscription =
+        std::make_shared<ProtobufSubscription<ProtoType>>(channel, callback_msg, policy, depth);
+    addSubscription(subscription);
     return subscription.get();
   }
 
@@ -117,26 +362,223 @@ class Shame {
    */
   bool unsubscribe(Subscription *subscription);
 
+  /**
+   * @brief get statistics of received messages, including transport latency and loss
+   * @return statistics per channel
+   */
+  std::unordered_map<std::string, ChannelStatistics> statistics() const;
+
+  /**
+   * @brief set capacity and overflow policy of internal queues
+   * @param packets queue of received udpm packets
+   * @param messages queue of reassembled messages waiting for dispatch
+   * @param max_incomplete_messages max number of udpm messages being reassembled
+   */
+  void setQueueOptions(const QueueOptions &packets, const QueueOptions &messages,
+                       const size_t max_incomplete_messages = 256);
+
+  /**
+   * @brief set capacity per lane and overflow policy of messages pending for publishAsync, the
+   * future of a dropped message is ready with 0 bytes published, and kDropOldest drops the oldest
+   * message of the lowest priority pending
+   * @param options capacity and overflow policy, 1024 messages dropping the oldest by default
+   */
+  void setAsyncQueueOptions(const QueueOptions &options);
+
+  /**
+   * @brief get statistics of internal queues, named "packets", "reassembly", "messages" and
+   * "async", and number of packets dropped as "unresolved" as the name of their channel was not
+   * announced in time
+   */
+  std::unordered_map<std::string, QueueStatistics> queueStatistics();
+
+  /**
+   * @brief check whether local subscribers of a channel are keeping up, i.e. none of the queues
+   * on their path is filled to half of its capacity or more
+   * @param channel channel name
+   */
+  bool keepingUp(const std::string &channel);
+
  protected:
+  /**
+   * @brief choose transport for a message of size, see setAutoTransport
+   * @param publication channel resolved by publication
+   * @param size length of message in bytes
+   * @param shared_memory set whether message goes via shared memory
+   * @param mirrored set whether message also goes via udpm to subscribers without the segment
+   */
+  void chooseTransport(Publication *publication, const size_t size, bool *shared_memory,
+                       bool *mirrored);
+
+  // see below
+  struct Channel;
+
+  /**
+   * @brief resolve channel for publishing with the shared memory segment of this instance, once
+   * per channel
+   */
+  Publication *publication(Channel *channel);
+
+  /**
+   * @brief find or construct shared memory block of channel, once per channel, throws on fail
+   */
+  ShameData *shameData(Channel *channel);
+
+  /**
+   * @brief publish raw data on interned channel
+   */
+  size_t publish(Channel *channel, const void *data, const size_t size, const bool shared_memory);
+
+  /**
+   * @brief publish protobuf message on interned channel
+   */
+  size_t publish(Channel *channel, const google::protobuf::MessageLite &msg,
+                 const bool shared_memory);
+
+  /**
+   * @brief put prefix, if any, followed by data into shared memory block of interned channel, and
+   * send its key
+   * @return bytes put, including prefix
+   */
+  size_t publishShm(Channel *channel, const void *prefix, const size_t size_prefix,
+                    const void *data, const size_t size);
+
+  /**
+   * @brief queue sending task of publishAsync
+   */
+  std::future<size_t> enqueueAsync(const std::string &channel,
+                                   const std::function<size_t()> &task);
+
+  /**
+   * @brief inner thread to send messages of publishAsync of urgent channels or of the others
+   */
+  void threadSend(const bool urgent);
+
+  /**
+   * @brief add listener of messages from transport if not added yet
+   */
+  void listen();
+
+  /**
+   * @brief start delivering of subscription and join groups of its channel
+   */
+  void addSubscription(const std::shared_ptr<Subscription> &subscription);
+
   /**
    * @brief callback function from udpm
    */
   void callbackReceive(const std::string &channel, const std::shared_ptr<uint8_t> &data, const size_t size,
-                       const bool shared_memory);
+                       const bool shared_memory, const bool urgent);
+
+  /**
+   * @brief callback function from udpm on message object published in process
+   */
+  void callbackLocal(const std::string &channel,
+                     const std::shared_ptr<const google::protobuf::MessageLite> &object,
+                     const bool shared_memory, const bool urgent);
+
+  /**
+   * @brief inner thread to dispatch messages of a lane
+   */
+  void threadDispatch(const Lane lane);
+
+  // subscriptions by channel pattern
+  using Subscriptions = std::unordered_map<std::string, std::list<std::shared_ptr<Subscription>>>;
+
+  // subscriptions matching a channel in snapshot, valid while generation equals generation_
+  struct Matched {
+    std::vector<Subscription *> subscriptions;
+    std::shared_ptr<const Subscriptions> snapshot;
+    uint64_t generation = 0;
+  };
+
+  // channel interned on first message, so that messages refer to it instead of copying its name
+  struct Channel {
+    std::string name;
+    // matched per lane, each lane is dispatched by a single thread, so no lock is taken even if
+    // messages of a channel come in both lanes
+    Matched matched[2];
+    // matched for keepingUp, which may be called on any thread
+    Matched matched_keeping_up;
+    std::mutex mutex_keeping_up;
+    // shared memory block keyed by name, blocks are never destroyed once constructed, resolved on
+    // first message by shameData or dispatch
+    std::atomic<ShameData *> shame_data{nullptr};
+    // resolved on first publishing by publication
+    std::atomic<Publication *> publication{nullptr};
+  };
+
+  /**
+   * @brief get interned channel of name, never released until destruction
+   */
+  Channel *intern(const std::string &name);
 
   /**
-   * @brief inner thread to dispatch messages
+   * @brief update subscriptions matching channel if subscribed or unsubscribed since last update
+   * @return subscriptions matching channel
    */
-  void threadDispatch();
+  const std::vector<Subscription *> &match(const Channel &channel, Matched *matched);
+
+  struct Message {
+    Channel *channel;
+    std::shared_ptr<uint8_t> data;
+    size_t size;
+    bool shared_memory;
+    // not null for message object published in process
+    std::shared_ptr<const google::protobuf::MessageLite> object;
+    bool urgent;
+  };
+
+  /**
+   * @brief inner function to dispatch message to matched subscriptions
+   */
+  void dispatch(const Message &msg);
 
  protected:
   std::shared_ptr<Udpm> udpm_;
   std::shared_ptr<Shm> shm_;
-  std::unordered_map<std::string, std::list<std::shared_ptr<Subscription>>> subscriptions_;
-  std::shared_ptr<ThreadSafeQueue<std::tuple<std::string, std::shared_ptr<uint8_t>, size_t, bool>>>
-      msg_queue_;
+  std::atomic<size_t> min_size_shm_;
+  // copy-on-write snapshot replaced by subscribe and unsubscribe, read without lock by dispatch
+  std::shared_ptr<const Subscriptions> subscriptions_;
+  std::mutex mutex_subscriptions_;
+  // bumped after each replacement of snapshot to invalidate subscriptions matched by channels
+  std::atomic<uint64_t> generation_;
+  // unsubscribed from their own callback, released on destruction
+  std::vector<std::shared_ptr<Subscription>> retired_;
+  std::unordered_map<std::string, std::unique_ptr<Channel>> channels_;
+  std::shared_mutex mutex_channels_;
+  std::shared_ptr<ThreadSafeQueue<Message>> msg_queue_;
+  // urgent messages are dispatched on a thread of their own
   std::shared_ptr<std::thread> handle_thread_dispatch_;
+  std::shared_ptr<std::thread> handle_thread_dispatch_urgent_;
   std::atomic<bool> enable_thread_dispatch_;
+  uint64_t listener_;
+  // number of messages dispatched by poll, touched by the polling thread only
+  size_t num_polled_;
+  // hash of name of shared memory segment, 0 for none
+  uint64_t segment_;
+  // instance polling on this thread
+  static thread_local Shame *polling_;
+
+  struct AsyncMessage {
+    std::function<size_t()> task;
+    std::promise<size_t> promise;
+  };
+  // pending messages of publishAsync ordered by negative priority and order of publishing
+  std::map<std::pair<int, uint64_t>, AsyncMessage> async_queue_;
+  uint64_t seq_async_ = 0;
+  QueueOptions async_options_;
+  // pending messages of publishAsync per lane, urgent second
+  size_t num_async_[2] = {0, 0};
+  uint64_t num_async_dropped_ = 0;
+  std::condition_variable cv_async_not_full_;
+  std::unordered_map<std::string, int> priorities_;
+  std::mutex mutex_async_;
+  std::condition_variable cv_async_;
+  // messages of positive priority are sent on a thread of their own
+  std::shared_ptr<std::thread> handle_thread_send_;
+  std::shared_ptr<std::thread> handle_thread_send_urgent_;
+  bool enable_thread_send_ = false;
 };
 
 }  // namespace shame
@@ -16,9 +16,15 @@
 #include <boost/interprocess/sync/interprocess_sharable_mutex.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/interprocess/sync/sharable_lock.hpp>
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <string>
+#include <thread>
 #include <utility>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace shame {
 
@@ -37,18 +43,101 @@ using Pair = std::pair<const K, M>;
 template <typename K, typename M>
 using Map = boost::container::map<K, M, std::less<K>, Allocator<Pair<K, M>>>;
 
+// shared between processes, so it has to be lock-free
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "atomic version must be lock-free");
+
+// optimistic reads in conflict with writers before falling back to the sharable lock
+static const size_t kMaxOptimisticReads = 64;
+
+// pauses while waiting for a write in progress before yielding, as the writer may need the cpu
+static const size_t kMaxPausesWriting = 128;
+
+/**
+ * @brief hint the cpu that this is a spin-wait loop
+ */
+inline void relaxCpu() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
 class ShameData {
  public:
   explicit ShameData(const boost::interprocess::managed_shared_memory& msm)
-      : data_(msm.get_segment_manager()) {}
+      : version_(0), data_(msm.get_segment_manager()) {}
 
  public:
   size_t size() const { return data_.size(); }
 
   const uint8_t* data() const { return data_.data(); }
 
+  /**
+   * @brief read data without blocking writers or writing to shared cache lines, f(data, size) may
+   * see data being written, so it must not keep or trust its result until read returns, and is
+   * invoked again on conflict, falls back to the sharable lock after max_reads conflicts, writes in
+   * progress are waited for without counting as conflicts
+   * @param f function reading data
+   * @param max_reads max number of optimistic reads
+   */
+  template <typename F>
+  void read(F f, const size_t max_reads = kMaxOptimisticReads) const {
+    size_t num_pauses = 0;
+    size_t num_conflicts = 0;
+    while (num_conflicts < max_reads) {
+      const uint64_t version = version_.load(std::memory_order_acquire);
+      if (version & 1) {
+        if (num_pauses++ < kMaxPausesWriting) {
+          relaxCpu();
+        } else {
+          std::this_thread::yield();
+        }
+        continue;
+      }
+
+      // buffer is reallocated on growth, so pointer and size are validated before dereferencing,
+      // freed buffers stay mapped in segment
+      const uint8_t* data = data_.data();
+      const size_t size = data_.size();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version_.load(std::memory_order_relaxed) != version) {
+        ++num_conflicts;
+        continue;
+      }
+
+      f(data, size);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version_.load(std::memory_order_relaxed) == version) {
+        return;
+      }
+      ++num_conflicts;
+    }
+
+    boost::interprocess::sharable_lock<boost::interprocess::interprocess_sharable_mutex> lock(
+        mutex_);
+    f(data_.data(), data_.size());
+  }
+
+  /**
+   * @brief mark data being written, called by writer holding mutex_
+   */
+  void beginWrite() {
+    version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  /**
+   * @brief mark data written, called by writer holding mutex_
+   */
+  void endWrite() {
+    version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
  public:
   mutable boost::interprocess::interprocess_sharable_mutex mutex_;
+  // odd while being written, see read
+  std::atomic<uint64_t> version_;
   Vector<uint8_t> data_;
 };
 
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include <getopt.h>
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "shame/log/log_reader.h"
+#include "shame/log/log_writer.h"
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " COMMAND [OPTIONS] ARGS" << std::endl
+            << "  info IN                      show channels and blocks of log" << std::endl
+            << "  filter [OPTIONS] IN OUT      copy selected channels and time range" << std::endl
+            << "    -c REGEX  channels to keep, all channels by default" << std::endl
+            << "    -b SEC    keep records from SEC seconds after the beginning of log"
+            << std::endl
+            << "    -e SEC    keep records until SEC seconds after the beginning of log"
+            << std::endl
+            << "  split [OPTIONS] IN PREFIX    split log into PREFIX_N.log by duration"
+            << std::endl
+            << "    -d SEC    duration of each part, 60 seconds by default" << std::endl
+            << "  merge [OPTIONS] OUT IN...    merge logs ordered by timestamp" << std::endl
+            << "  OPTIONS of all commands writing logs:" << std::endl
+            << "    -z        compress rewritten blocks" << std::endl;
+}
+
+/**
+ * @brief names of channels of a block
+ */
+std::vector<std::string> blockChannels(const shame::LogReader &reader, const size_t block) {
+  std::vector<std::string> channels;
+  for (auto id : reader.blocks()[block].channels) {
+    channels.push_back(reader.channels()[id]);
+  }
+  return channels;
+}
+
+/**
+ * @brief copy records of selected channels in time range [t_begin, t_end], blocks fully selected
+ * are copied as is without decompressing
+ */
+void copyRange(const shame::LogReader &reader, shame::LogWriter *writer,
+               const std::vector<bool> &selected, const uint64_t t_begin, const uint64_t t_end) {
+  for (size_t block = reader.seek(t_begin); block < reader.blocks().size(); ++block) {
+    const auto &index = reader.blocks()[block].index;
+    if (index.t_first > t_end) {
+      break;
+    }
+
+    bool any = false;
+    bool all = true;
+    for (auto id : reader.blocks()[block].channels) {
+      any = any || selected[id];
+      all = all && selected[id];
+    }
+    if (!any) {
+      continue;
+    }
+
+    if (all && index.t_first >= t_begin && index.t_last <= t_end) {
+      shame::LogBlockHeader header;
+      const uint8_t *data;
+      if (reader.readRawBlock(block, &header, &data)) {
+        writer->writeBlock(header, data, blockChannels(reader, block));
+      }
+      continue;
+    }
+
+    reader.readBlock(block, [&](const shame::LogRecord &record) {
+      if (record.timestamp >= t_begin && record.timestamp <= t_end &&
+          record.channel_id != shame::kLogChannelUnknown && selected[record.channel_id]) {
+        writer->write(record.timestamp, record.channel, record.data, record.size,
+                      record.shared_memory);
+      }
+      return true;
+    });
+  }
+}
+
+int info(const std::string &path) {
+  shame::LogReader reader(path);
+  std::cout << "Log " << path << ": " << (reader.endTime() - reader.startTime()) / 1e6
+            << " seconds, " << reader.blocks().size() << " blocks, " << reader.channels().size()
+            << " channels" << std::endl;
+
+  std::unordered_map<std::string, uint64_t> num_records;
+  uint64_t len_data = 0;
+  uint64_t len_raw = 0;
+  for (size_t block = 0; block < reader.blocks().size(); ++block) {
+    shame::LogBlockHeader header;
+    const uint8_t *data;
+    if (!reader.readRawBlock(block, &header, &data)) {
+      continue;
+    }
+    len_data += header.len_data;
+    len_raw += header.len_raw;
+    reader.readBlock(block, [&num_records](const shame::LogRecord &record) {
+      ++num_records[record.channel];
+      return true;
+    });
+  }
+
+  std::cout << "Stored " << len_data << " bytes of " << len_raw << " bytes" << std::endl;
+  for (const auto &name : reader.channels()) {
+    std::cout << "  " << std::left << std::setw(32) << name << num_records[name] << " messages"
+              << std::endl;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  const std::string command(argv[1]);
+
+  std::string channel(".*");
+  double begin = 0.0;
+  double end = -1.0;
+  double duration = 60.0;
+  uint32_t compression = shame::kLogCompressionNone;
+
+  int opt;
+  while ((opt = getopt(argc - 1, argv + 1, "c:b:e:d:zh")) != -1) {
+    switch (opt) {
+      case 'c':
+        channel = optarg;
+        break;
+      case 'b':
+        begin = std::stod(optarg);
+        break;
+      case 'e':
+        end = std::stod(optarg);
+        break;
+      case 'd':
+        duration = std::stod(optarg);
+        break;
+      case 'z':
+        compression = shame::kLogCompressionZlib;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  std::vector<std::string> args(argv + 1 + optind, argv + argc);
+
+  try {
+    if (command == "info" && args.size() == 1) {
+      return info(args[0]);
+    } else if (command == "filter" && args.size() == 2) {
+      shame::LogReader reader(args[0]);
+      shame::LogWriter writer(args[1], 16 * 1024 * 1024, compression);
+
+      const std::regex pattern(channel);
+      std::vector<bool> selected;
+      for (const auto &name : reader.channels()) {
+        selected.push_back(std::regex_match(name, pattern));
+      }
+      const uint64_t t_begin = reader.startTime() + static_cast<uint64_t>(begin * 1e6);
+      const uint64_t t_end = (end < 0.0 ? std::numeric_limits<uint64_t>::max()
+                                        : reader.startTime() + static_cast<uint64_t>(end * 1e6));
+      copyRange(reader, &writer, selected, t_begin, t_end);
+      writer.close();
+      std::cout << "Wrote " << writer.numRecords() << " messages to " << args[1] << std::endl;
+    } else if (command == "split" && args.size() == 2 && duration > 0.0) {
+      shame::LogReader reader(args[0]);
+      const std::vector<bool> selected(reader.channels().size(), true);
+      const uint64_t step = static_cast<uint64_t>(duration * 1e6);
+      size_t part = 0;
+      for (uint64_t t = reader.startTime(); t <= reader.endTime(); t += step, ++part) {
+        std::ostringstream path;
+        path << args[1] << "_" << std::setw(3) << std::setfill('0') << part << ".log";
+        shame::LogWriter writer(path.str(), 16 * 1024 * 1024, compression);
+        copyRange(reader, &writer, selected, t, t + step - 1);
+        writer.close();
+        std::cout << "Wrote " << writer.numRecords() << " messages to " << path.str()
+                  << std::endl;
+      }
+    } else if (command == "merge" && args.size() >= 2) {
+      std::vector<std::unique_ptr<shame::LogReader>> readers;
+      // t_first, t_last, reader, block
+      std::vector<std::tuple<uint64_t, uint64_t, size_t, size_t>> blocks;
+      for (size_t i = 1; i < args.size(); ++i) {
+        readers.emplace_back(new shame::LogReader(args[i]));
+        for (size_t block = 0; block < readers.back()->blocks().size(); ++block) {
+          const auto &index = readers.back()->blocks()[block].index;
+          blocks.emplace_back(index.t_first, index.t_last, readers.size() - 1, block);
+        }
+      }
+      std::sort(blocks.begin(), blocks.end());
+
+      shame::LogWriter writer(args[0], 16 * 1024 * 1024, compression);
+      for (size_t i = 0; i < blocks.size();) {
+        // group of blocks overlapping in time
+        size_t j = i + 1;
+        uint64_t t_last = std::get<1>(blocks[i]);
+        while (j < blocks.size() && std::get<0>(blocks[j]) <= t_last) {
+          t_last = std::max(t_last, std::get<1>(blocks[j]));
+          ++j;
+        }
+
+        if (j == i + 1) {
+          // not overlapping any other block, copied as is
+          const auto &reader = *readers[std::get<2>(blocks[i])];
+          shame::LogBlockHeader header;
+          const uint8_t *data;
+          if (reader.readRawBlock(std::get<3>(blocks[i]), &header, &data)) {
+            writer.writeBlock(header, data, blockChannels(reader, std::get<3>(blocks[i])));
+          }
+        } else {
+          struct Record {
+            uint64_t timestamp;
+            std::string channel;
+            std::string data;
+            bool shared_memory;
+          };
+          std::vector<Record> records;
+          for (size_t k = i; k < j; ++k) {
+            readers[std::get<2>(blocks[k])]->readBlock(
+                std::get<3>(blocks[k]), [&records](const shame::LogRecord &record) {
+                  records.push_back({record.timestamp, record.channel,
+                                     std::string(reinterpret_cast<const char *>(record.data),
+                                                 record.size),
+                                     record.shared_memory});
+                  return true;
+                });
+          }
+          std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) {
+            return a.timestamp < b.timestamp;
+          });
+          for (const auto &record : records) {
+            writer.write(record.timestamp, record.channel, record.data.data(), record.data.size(),
+                         record.shared_memory);
+          }
+        }
+        i = j;
+      }
+      writer.close();
+      std::cout << "Wrote " << writer.numRecords() << " messages to " << args[0] << std::endl;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
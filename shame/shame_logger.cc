@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include "shame/common/time.h"
+#include "shame/log/log_writer.h"
+#include "shame/shame.h"
+
+std::atomic<bool> running(true);
+
+void sig_handler(int sig) {
+  if (sig == SIGINT || sig == SIGTERM) {
+    running.store(false);
+  }
+}
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " [OPTIONS] FILE" << std::endl
+            << "  -c REGEX  channels to record, all channels by default" << std::endl
+            << "  -b SIZE   size of block in bytes, 16 MB by default" << std::endl
+            << "  -s NAME   name of shared memory, \"Shame\" by default" << std::endl
+            << "  -z        compress blocks" << std::endl
+            << "  -j NUM    number of threads compressing blocks, 2 by default, at least 1" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::string channel(".*");
+  size_t size_block = 16 * 1024 * 1024;
+  std::string name_shm("Shame");
+  uint32_t compression = shame::kLogCompressionNone;
+  size_t num_threads_compression = 2;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:b:s:zj:h")) != -1) {
+    switch (opt) {
+      case 'c':
+        channel = optarg;
+        break;
+      case 'b':
+        size_block = std::stoull(optarg);
+        break;
+      case 's':
+        name_shm = optarg;
+        break;
+      case 'z':
+        compression = shame::kLogCompressionZlib;
+        break;
+      case 'j':
+        num_threads_compression = std::stoull(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::unique_ptr<shame::LogWriter> writer;
+  try {
+    writer.reset(
+        new shame::LogWriter(argv[optind], size_block, compression, num_threads_compression));
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+
+  shame::Shame shame("239.255.67.76", 6776, 0, name_shm);
+  shame.subscribe(
+      channel,
+      [&writer](const std::string &channel, const std::shared_ptr<uint8_t> &data,
+                const size_t size) { writer->write(shame::now(), channel, data.get(), size, false); },
+      [&writer](const std::string &channel, const shame::ShameData *shame_data) {
+        const auto t = shame::now();
+        shame_data->mutex_.lock_sharable();
+        writer->write(t, channel, shame_data->data(), shame_data->size(), true);
+        shame_data->mutex_.unlock_sharable();
+      });
+  shame.startHandling();
+  std::cout << "Recording channels " << channel << " to " << argv[optind] << std::endl;
+
+  while (running.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  shame.stopHandling();
+  writer->close();
+  std::cout << "Recorded " << writer->numRecords() << " messages, " << writer->numBytes()
+            << " bytes" << std::endl;
+
+  return 0;
+}
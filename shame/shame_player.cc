@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <regex>
+#include <thread>
+#include <vector>
+#include "shame/common/time.h"
+#include "shame/log/log_reader.h"
+#include "shame/shame.h"
+
+std::atomic<bool> running(true);
+
+void sig_handler(int sig) {
+  if (sig == SIGINT || sig == SIGTERM) {
+    running.store(false);
+  }
+}
+
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " [OPTIONS] FILE" << std::endl
+            << "  -c REGEX  channels to play, all channels by default" << std::endl
+            << "  -r RATE   playback rate, 1.0 by default, 0 for as fast as possible" << std::endl
+            << "  -t SEC    start from SEC seconds after the beginning of log" << std::endl
+            << "  -l        loop playback" << std::endl
+            << "  -u        publish all messages via udpm" << std::endl
+            << "  -s NAME   name of shared memory, \"Shame\" by default" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::string channel(".*");
+  double rate = 1.0;
+  double start = 0.0;
+  bool loop = false;
+  bool udpm_only = false;
+  std::string name_shm("Shame");
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:r:t:lus:h")) != -1) {
+    switch (opt) {
+      case 'c':
+        channel = optarg;
+        break;
+      case 'r':
+        rate = std::stod(optarg);
+        break;
+      case 't':
+        start = std::stod(optarg);
+        break;
+      case 'l':
+        loop = true;
+        break;
+      case 'u':
+        udpm_only = true;
+        break;
+      case 's':
+        name_shm = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc || rate < 0.0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::unique_ptr<shame::LogReader> reader;
+  try {
+    reader.reset(new shame::LogReader(argv[optind]));
+  } catch (std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return 1;
+  }
+
+  // resolve channel filter once per channel of log
+  const std::regex pattern(channel);
+  std::vector<bool> channel_selected;
+  for (const auto &name : reader->channels()) {
+    channel_selected.push_back(std::regex_match(name, pattern));
+  }
+
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+
+  shame::Shame shame("239.255.67.76", 6776, 0, (udpm_only ? "" : name_shm));
+
+  const uint64_t t_start = reader->startTime() + static_cast<uint64_t>(start * 1e6);
+  const size_t block_start = reader->seek(t_start);
+  std::cout << "Playing " << reader->blocks().size() - block_start << " blocks of "
+            << argv[optind] << " at rate " << rate << std::endl;
+
+  uint64_t num_messages = 0;
+  uint64_t num_bytes = 0;
+  const auto t_begin = shame::nowMonotonic();
+  do {
+    const auto t_play = shame::nowMonotonic();
+    const auto num_messages_pass = num_messages;
+    for (size_t block = block_start; block < reader->blocks().size() && running.load(); ++block) {
+      // skip blocks without any selected channel
+      bool selected = false;
+      for (auto id : reader->blocks()[block].channels) {
+        selected = selected || channel_selected[id];
+      }
+      if (!selected) {
+        continue;
+      }
+
+      reader->readBlock(block, [&](const shame::LogRecord &record) {
+        if (record.timestamp < t_start || record.channel_id == shame::kLogChannelUnknown ||
+            !channel_selected[record.channel_id]) {
+          return running.load();
+        }
+
+        if (rate > 0.0) {
+          const auto t = t_play + static_cast<uint64_t>((record.timestamp - t_start) / rate);
+          const auto t_now = shame::nowMonotonic();
+          if (t > t_now) {
+            std::this_thread::sleep_for(std::chrono::microseconds(t - t_now));
+          }
+        }
+
+        num_bytes += shame.publish(record.channel, record.data, record.size,
+                                   record.shared_memory && !udpm_only);
+        ++num_messages;
+        return running.load();
+      });
+    }
+
+    // nothing to loop over, e.g. empty log or no channel selected
+    if (num_messages == num_messages_pass) {
+      if (loop) {
+        std::cout << "No message selected to play" << std::endl;
+      }
+      break;
+    }
+  } while (loop && running.load());
+
+  const auto duration = shame::nowMonotonic() - t_begin;
+  std::cout << "Published " << num_messages << " messages, " << num_bytes << " bytes in "
+            << duration / 1e6 << " seconds ("
+            << (duration == 0 ? 0.0 : num_messages * 1e6 / duration) << " messages/s, "
+            << (duration == 0 ? 0.0 : num_bytes / 1.048576 / duration) << " MB/s)" << std::endl;
+
+  return 0;
+}
@@ -6,29 +6,70 @@
  * Date: Sept.08, 2019
  */
 
+#include <getopt.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <iostream>
 #include <memory>
 #include <thread>
+#include "shame/common/memory.h"
 
 namespace bi = boost::interprocess;
 
 class ShameServer {
  public:
-  ShameServer(const std::string &name, const size_t size) : name_(name) {
+  /**
+   * @brief constructor of ShameServer, create shared memory segment
+   * @param name name of segment
+   * @param size size of segment in bytes
+   * @param huge_pages whether advise transparent huge pages
+   * @param prefault whether allocate all pages in advance
+   * @param lock whether lock all pages in memory
+   */
+  ShameServer(const std::string &name, const size_t size, const bool huge_pages,
+              const bool prefault, const bool lock)
+      : name_(name) {
     bi::shared_memory_object::remove(name_.c_str());
-    bi::managed_shared_memory segment(bi::create_only, name_.c_str(), size);
+    segment_.reset(new bi::managed_shared_memory(bi::create_only, name_.c_str(), size));
     std::cout << "Allocated " << size << " bytes for shared memory segment: " << name_ << std::endl;
+
+    // the mapping is kept, so that pages locked stay locked
+    auto address = segment_->get_address();
+    if (huge_pages) {
+      if (!shame::adviseHugePages(address, size)) {
+        std::cout << "Failed to advise huge pages" << std::endl;
+      } else {
+        // clients map the segment on their own, and advise huge pages once told so
+        segment_->construct<bool>(shame::kNameHugePages)(true);
+        if (!shame::hugePagesEnabledForSharedMemory()) {
+          std::cout << "Huge pages advised but disabled for shared memory, see "
+                    << "mount -o remount,huge=advise /dev/shm" << std::endl;
+        }
+      }
+    }
+    if (prefault) {
+      shame::prefault(address, size);
+      std::cout << "Pre-faulted shared memory segment" << std::endl;
+    }
+    if (lock) {
+      if (mlock(address, size) == 0) {
+        std::cout << "Locked shared memory segment in memory" << std::endl;
+      } else {
+        std::cout << "Failed to lock shared memory segment, check ulimit -l" << std::endl;
+      }
+    }
   }
 
   ~ShameServer() {
+    segment_.reset();
     bi::shared_memory_object::remove(name_.c_str());
     std::cout << "Removed shared memory segment: " << name_ << std::endl;
   }
 
  protected:
   const std::string name_;
+  std::unique_ptr<bi::managed_shared_memory> segment_;
 };
 
 std::unique_ptr<ShameServer> shame_server;
@@ -41,15 +82,45 @@ void sig_handler(int sig) {
   }
 }
 
+void usage(const char *name) {
+  std::cout << "Usage: " << name << " [OPTIONS] NAME SIZE" << std::endl
+            << "  -H  back segment with transparent huge pages" << std::endl
+            << "  -p  pre-fault all pages of segment" << std::endl
+            << "  -l  lock all pages of segment in memory" << std::endl;
+}
+
 int main(int argc, char **argv) {
-  if (argc < 3) {
-    std::cout << "Usage: " << argv[0] << " NAME SIZE" << std::endl;
+  bool huge_pages = false;
+  bool prefault = false;
+  bool lock = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "Hplh")) != -1) {
+    switch (opt) {
+      case 'H':
+        huge_pages = true;
+        break;
+      case 'p':
+        prefault = true;
+        break;
+      case 'l':
+        lock = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    usage(argv[0]);
+    return 1;
   }
 
   signal(SIGINT, sig_handler);
 
   try {
-    shame_server.reset(new ShameServer(argv[1], std::stoi(argv[2])));
+    shame_server.reset(new ShameServer(argv[optind], std::stoull(argv[optind + 1]), huge_pages,
+                                       prefault, lock));
   } catch (std::exception &e) {
     std::cout << e.what() << std::endl;
   }
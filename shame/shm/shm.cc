@@ -7,13 +7,40 @@
  */
 
 #include "shame/shm/shm.h"
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include "shame/common/copy.h"
+#include "shame/common/memory.h"
 #include "shame/shame_data.h"
 
 namespace bi = boost::interprocess;
 
 namespace shame {
 
-Shm::Shm(const std::string &name) : msm_(bi::open_only, name.c_str()) {}
+Shm::Shm(const std::string &name) : msm_(bi::open_only, name.c_str()) {
+  // huge pages are mapped as such only into mappings advised, see shame_server
+  if (msm_.find<bool>(kNameHugePages).first) {
+    adviseHugePages(msm_.get_address(), msm_.get_size());
+  }
+
+  // so that the first message of a channel is as fast as the following ones
+  prefault(msm_.get_address(), msm_.get_size());
+}
+
+std::shared_ptr<Shm> Shm::instance(const std::string &name) {
+  static std::mutex mutex;
+  static std::unordered_map<std::string, std::weak_ptr<Shm>> instances;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &item = instances[name];
+  auto shm = item.lock();
+  if (!shm) {
+    shm.reset(new Shm(name));
+    item = shm;
+  }
+  return shm;
+}
 
 ShameData *Shm::find(const std::string &key) { return msm_.find<ShameData>(key.c_str()).first; }
 
@@ -22,28 +49,54 @@ ShameData *Shm::find_or_construct(const std::string &key) {
 }
 
 size_t Shm::put(const std::string &key, const void *data, const size_t size) {
-  auto shame_data = find_or_construct(key);
+  return put(find_or_construct(key), data, size);
+}
+
+size_t Shm::put(const std::string &key, const google::protobuf::MessageLite &msg) {
+  return put(find_or_construct(key), msg);
+}
+
+size_t Shm::put(ShameData *shame_data, const void *data, const size_t size) {
   if (!shame_data) {
     return 0;
   }
 
   shame_data->mutex_.lock();
+  shame_data->beginWrite();
   shame_data->data_.resize(size);
-  memcpy(shame_data->data_.data(), data, size);
+  copy(shame_data->data_.data(), data, size);
+  shame_data->endWrite();
   shame_data->mutex_.unlock();
   return size;
 }
 
-size_t Shm::put(const std::string &key, const google::protobuf::MessageLite &msg) {
-  auto shame_data = find_or_construct(key);
+size_t Shm::put(ShameData *shame_data, const void *prefix, const size_t size_prefix,
+                const void *data, const size_t size) {
+  if (!shame_data) {
+    return 0;
+  }
+
+  shame_data->mutex_.lock();
+  shame_data->beginWrite();
+  shame_data->data_.resize(size_prefix + size);
+  memcpy(shame_data->data_.data(), prefix, size_prefix);
+  copy(shame_data->data_.data() + size_prefix, data, size);
+  shame_data->endWrite();
+  shame_data->mutex_.unlock();
+  return size_prefix + size;
+}
+
+size_t Shm::put(ShameData *shame_data, const google::protobuf::MessageLite &msg) {
   if (!shame_data) {
     return 0;
   }
 
-  auto size = msg.ByteSize();
+  auto size = msg.ByteSizeLong();
   shame_data->mutex_.lock();
+  shame_data->beginWrite();
   shame_data->data_.resize(size);
   msg.SerializeToArray(shame_data->data_.data(), size);
+  shame_data->endWrite();
   shame_data->mutex_.unlock();
 
   return size;
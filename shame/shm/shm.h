@@ -10,6 +10,7 @@
 
 #include <google/protobuf/message_lite.h>
 #include <boost/interprocess/managed_shared_memory.hpp>
+#include <memory>
 #include <string>
 
 namespace shame {
@@ -19,11 +20,19 @@ class ShameData;
 class Shm {
  public:
   /**
-   * @brief constructor, open managed shared memory (open only, throws on fail)
+   * @brief constructor, open managed shared memory (open only, throws on fail), all pages are
+   * mapped in advance, huge pages advised if the server backs the segment with them
    * @param name name of managed shared memory
    */
   explicit Shm(const std::string &name);
 
+  /**
+   * @brief get the instance shared in process for the given name, opened on first use and closed
+   * when no longer referenced, throws on fail
+   * @param name name of managed shared memory
+   */
+  static std::shared_ptr<Shm> instance(const std::string &name);
+
  public:
   /**
    * @brief find named segment
@@ -56,6 +65,37 @@ class Shm {
    */
   size_t put(const std::string &key, const google::protobuf::MessageLite &msg);
 
+  /**
+   * @brief put data into segment found or constructed before, without lookup by name
+   * @param shame_data segment
+   * @param data pointer of data to be put
+   * @param size length (in bytes) to be put
+   * @return bytes transfered
+   */
+  size_t put(ShameData *shame_data, const void *data, const size_t size);
+
+  /**
+   * @brief put a prefix followed by data into segment found or constructed before, both copied in
+   * place, without assembling them first
+   * @param shame_data segment
+   * @param prefix pointer of prefix, e.g. a header
+   * @param size_prefix length (in bytes) of prefix
+   * @param data pointer of data following prefix
+   * @param size length (in bytes) of data
+   * @return bytes transfered, including prefix
+   */
+  size_t put(ShameData *shame_data, const void *prefix, const size_t size_prefix, const void *data,
+             const size_t size);
+
+  /**
+   * @brief serialize protobuf message into segment found or constructed before, without lookup by
+   * name
+   * @param shame_data segment
+   * @param msg protobuf message
+   * @return bytes transfered (serialized protobuf message)
+   */
+  size_t put(ShameData *shame_data, const google::protobuf::MessageLite &msg);
+
  protected:
   boost::interprocess::managed_shared_memory msm_;
 };
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace shame {
+
+struct ChannelStatistics {
+  // number of messages received
+  uint64_t num_messages = 0;
+  // number of messages lost, detected by gaps of sequence number
+  uint64_t num_lost = 0;
+  // transport latency in microseconds, valid between processes on the same host
+  uint64_t latency_last = 0;
+  uint64_t latency_max = 0;
+  uint64_t latency_sum = 0;
+
+  /**
+   * @brief get average transport latency in microseconds
+   */
+  double latencyAverage() const {
+    return (num_messages == 0 ? 0.0 : static_cast<double>(latency_sum) / num_messages);
+  }
+};
+
+}  // namespace shame
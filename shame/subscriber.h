@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#include <google/protobuf/message_lite.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include "shame/shame.h"
+
+namespace shame {
+
+template <typename ProtoType,
+          typename std::enable_if<
+              std::is_base_of<google::protobuf::MessageLite, ProtoType>::value>::type * = nullptr>
+class Subscriber {
+ public:
+  /**
+   * @brief constructor of protobuf subscriber, subscribed until destruction, the channel is
+   * resolved once on its first message like any other subscription
+   * @param shame instance to subscribe by, must outlive this subscriber
+   * @param channel channel name (regex supported, see literalPattern for names taken literally)
+   * @param callback_msg callback function on message
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
+   */
+  Subscriber(Shame &shame, const std::string &channel,
+             const std::function<void(const std::string &, const std::shared_ptr<ProtoType> &,
+                                      const bool)> &callback_msg,
+             const DeliveryPolicy policy = DeliveryPolicy::kKeepAll, const size_t depth = 1)
+      : shame_(&shame),
+        subscription_(shame.subscribe<ProtoType>(channel, callback_msg, policy, depth)) {}
+
+  Subscriber(const Subscriber &) = delete;
+  Subscriber &operator=(const Subscriber &) = delete;
+
+  Subscriber(Subscriber &&other) : shame_(other.shame_), subscription_(other.subscription_) {
+    other.subscription_ = nullptr;
+  }
+
+  /**
+   * @brief destructor, unsubscribe
+   */
+  ~Subscriber() { unsubscribe(); }
+
+ public:
+  /**
+   * @brief unsubscribe, callback is not invoked once this returns
+   */
+  void unsubscribe() {
+    if (subscription_) {
+      shame_->unsubscribe(subscription_);
+      subscription_ = nullptr;
+    }
+  }
+
+  /**
+   * @brief get handle of subscription, nullptr once unsubscribed
+   */
+  Subscription *subscription() const { return subscription_; }
+
+ protected:
+  Shame *shame_;
+  Subscription *subscription_;
+};
+
+}  // namespace shame
@@ -9,24 +9,54 @@
 #pragma once
 
 #include <google/protobuf/message_lite.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include "shame/common/thread_safe_queue.h"
 #include "shame/shame_data.h"
 
 namespace shame {
 
+enum class DeliveryPolicy {
+  // deliver every message on the dispatch thread, i.e. concurrently on the thread of urgent
+  // channels for a pattern matching both urgent and other channels
+  kKeepAll,
+  // keep the last N pending messages, delivered on a thread of the subscription
+  kKeepLast,
+  // keep the latest pending message only, delivered on a thread of the subscription
+  kConflate,
+};
+
 class Subscription {
  public:
   /**
    * @brief constructor of subscription
-   * @param channel channel name (regex supported)
+   * @param channel channel name (regex supported, see literalPattern for names taken literally)
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
    */
-  explicit Subscription(const std::string &channel) : channel_(channel) {}
+  explicit Subscription(const std::string &channel,
+                        const DeliveryPolicy policy = DeliveryPolicy::kKeepAll,
+                        const size_t depth = 1)
+      : channel_(channel),
+        policy_(policy),
+        mailbox_(policy == DeliveryPolicy::kConflate ? 1 : std::max<size_t>(depth, 1),
+                 OverflowPolicy::kDropOldest),
+        enable_thread_deliver_(false),
+        active_(true),
+        num_invoking_(0),
+        optimistic_read_(false) {}
 
-  virtual ~Subscription() {}
+  virtual ~Subscription() { stopDelivering(); }
 
  public:
   /**
@@ -34,6 +64,155 @@ class Subscription {
    */
   std::string channel() const { return channel_; }
 
+  /**
+   * @brief get delivery policy
+   */
+  DeliveryPolicy policy() const { return policy_; }
+
+  /**
+   * @brief get number of messages dropped as stale before delivery
+   */
+  uint64_t numDropped() { return mailbox_.numDropped(); }
+
+  /**
+   * @brief get size, capacity and number of dropped messages of pending messages
+   */
+  QueueStatistics queueStatistics() { return mailbox_.statistics(); }
+
+  /**
+   * @brief read shared memory messages optimistically instead of under the sharable lock, so that
+   * publishers are never blocked by this subscriber, see ShameData::read, parsing is repeated on
+   * conflict with a publisher and structs are copied out of shared memory
+   */
+  void setOptimisticRead(const bool enable) { optimistic_read_.store(enable); }
+
+  /**
+   * @brief whether pending messages pile up, i.e. the consumer is not keeping up
+   */
+  bool congested() { return mailbox_.congested(); }
+
+  /**
+   * @brief start the thread delivering pending messages, no-op for DeliveryPolicy::kKeepAll
+   */
+  void startDelivering() {
+    if (policy_ == DeliveryPolicy::kKeepAll || !active_.load() || handle_thread_deliver_) {
+      return;
+    }
+    mailbox_.reset();
+    enable_thread_deliver_.store(true);
+    handle_thread_deliver_.reset(new std::thread(&Subscription::threadDeliver, this));
+  }
+
+  /**
+   * @brief stop the thread delivering pending messages, must be called before destruction of
+   * derived classes
+   */
+  void stopDelivering() {
+    enable_thread_deliver_.store(false);
+    mailbox_.breakAllWait();
+    // stopped from its own callback, the thread exits on return and is joined later
+    if (handle_thread_deliver_ && handle_thread_deliver_->get_id() != std::this_thread::get_id()) {
+      handle_thread_deliver_->join();
+      handle_thread_deliver_.reset();
+    }
+  }
+
+  /**
+   * @brief stop delivering for good, waits for callbacks in progress on other threads, so that
+   * callback is never invoked once this returns
+   */
+  void deactivate() {
+    active_.store(false);
+    stopDelivering();
+    const int num_self = (invoking_ == this ? 1 : 0);
+    std::unique_lock<std::mutex> lock(mutex_deactivate_);
+    cv_deactivate_.wait(lock, [this, num_self]() { return num_invoking_.load() <= num_self; });
+  }
+
+  /**
+   * @brief whether callback of this subscription is being invoked on the caller thread
+   */
+  bool invoking() const { return invoking_ == this; }
+
+  /**
+   * @brief deliver pending messages on the caller thread, for polling without delivering thread
+   * @param max_messages max number of messages delivered, 0 for unlimited
+   * @return number of messages delivered
+   */
+  size_t deliverPending(const size_t max_messages) {
+    size_t num = 0;
+    Pending pending;
+    while ((max_messages == 0 || num < max_messages) && mailbox_.dequeue(&pending)) {
+      deliver(pending);
+      ++num;
+    }
+    return num;
+  }
+
+  /**
+   * @brief deliver udpm message according to delivery policy, urgent messages overtake pending
+   * ones
+   */
+  void deliverUdpm(const std::string &channel, const std::shared_ptr<uint8_t> &data,
+                   const size_t size, const bool urgent = false) {
+    if (policy_ == DeliveryPolicy::kKeepAll) {
+      Invocation invocation(this);
+      if (invocation.active()) {
+        callbackReceiveUdpm(channel, data, size);
+      }
+    } else {
+      mailbox_.enqueue({&channel, data, size, nullptr, nullptr, false}, urgent);
+    }
+  }
+
+  /**
+   * @brief deliver shm message according to delivery policy
+   */
+  void deliverShm(const std::string &channel, const ShameData *shame_data,
+                  const bool urgent = false) {
+    if (policy_ == DeliveryPolicy::kKeepAll) {
+      Invocation invocation(this);
+      if (invocation.active()) {
+        callbackReceiveShm(channel, shame_data);
+      }
+    } else {
+      mailbox_.enqueue({&channel, nullptr, 0, shame_data, nullptr, false}, urgent);
+    }
+  }
+
+  /**
+   * @brief deliver message object published in process according to delivery policy
+   * @return false if not accepted by this subscription, which is then delivered as serialized
+   */
+  bool deliverObject(const std::string &channel,
+                     const std::shared_ptr<const google::protobuf::MessageLite> &object,
+                     const bool shared_memory, const bool urgent = false) {
+    if (!acceptsObject(*object)) {
+      return false;
+    }
+    if (policy_ == DeliveryPolicy::kKeepAll) {
+      Invocation invocation(this);
+      if (invocation.active()) {
+        callbackReceiveObject(channel, object, shared_memory);
+      }
+    } else {
+      mailbox_.enqueue({&channel, nullptr, 0, nullptr, object, shared_memory}, urgent);
+    }
+    return true;
+  }
+
+  /**
+   * whether message object published in process could be delivered as is
+   */
+  virtual bool acceptsObject(const google::protobuf::MessageLite &) const { return false; }
+
+  /**
+   * callback function on message object published in process
+   */
+  virtual void callbackReceiveObject(const std::string &,
+                                     const std::shared_ptr<const google::protobuf::MessageLite> &,
+                                     const bool) {}
+
   /**
    * callback function from lower level on udpm message
    */
@@ -45,8 +224,112 @@ class Subscription {
    */
   virtual void callbackReceiveShm(const std::string &channel, const ShameData *shame_data) = 0;
 
+ protected:
+  struct Pending {
+    // interned by Shame, which outlives its subscriptions
+    const std::string *channel;
+    std::shared_ptr<uint8_t> data;
+    size_t size;
+    // not null for shm message
+    const ShameData *shame_data;
+    // not null for message object published in process
+    std::shared_ptr<const google::protobuf::MessageLite> object;
+    bool shared_memory;
+  };
+
+  /**
+   * @brief invoke f(data, size) on shared memory data, optimistically or under the sharable lock
+   */
+  template <typename F>
+  void readShm(const ShameData *shame_data, F f) const {
+    if (optimistic_read_.load()) {
+      shame_data->read(f);
+    } else {
+      shame_data->mutex_.lock_sharable();
+      f(shame_data->data(), shame_data->size());
+      shame_data->mutex_.unlock_sharable();
+    }
+  }
+
+  /**
+   * @brief marks callback of a subscription in progress on the current thread, checked by
+   * deactivate, takes no lock, so that urgent channels never wait for callbacks of others, see
+   * DeliveryPolicy
+   */
+  class Invocation {
+   public:
+    explicit Invocation(Subscription *subscription)
+        : subscription_(subscription), previous_(invoking_) {
+      subscription_->num_invoking_.fetch_add(1);
+      invoking_ = subscription_;
+    }
+
+    ~Invocation() {
+      invoking_ = previous_;
+      subscription_->num_invoking_.fetch_sub(1);
+      // counted down before checking active_, so deactivate either sees the count or is notified,
+      // while callbacks of active subscriptions take no lock at all
+      if (!subscription_->active_.load()) {
+        std::lock_guard<std::mutex> lock(subscription_->mutex_deactivate_);
+        subscription_->cv_deactivate_.notify_all();
+      }
+    }
+
+    /**
+     * @brief whether callback may be invoked, i.e. not deactivated
+     */
+    bool active() const { return subscription_->active_.load(); }
+
+   protected:
+    Subscription *subscription_;
+    const Subscription *previous_;
+  };
+
+  /**
+   * @brief inner thread to deliver pending messages, parsing happens here so that stale messages
+   * are dropped before any work is done on them
+   */
+  void threadDeliver() {
+    while (enable_thread_deliver_.load()) {
+      Pending pending;
+      if (!mailbox_.waitDequeue(&pending)) {
+        continue;
+      }
+      deliver(pending);
+    }
+  }
+
+  /**
+   * @brief inner function to invoke callback on a pending message
+   */
+  void deliver(const Pending &pending) {
+    Invocation invocation(this);
+    if (!invocation.active()) {
+      return;
+    }
+    if (pending.object) {
+      callbackReceiveObject(*pending.channel, pending.object, pending.shared_memory);
+    } else if (pending.shame_data) {
+      callbackReceiveShm(*pending.channel, pending.shame_data);
+    } else {
+      callbackReceiveUdpm(*pending.channel, pending.data, pending.size);
+    }
+  }
+
  protected:
   std::string channel_;
+  const DeliveryPolicy policy_;
+  ThreadSafeQueue<Pending> mailbox_;
+  std::shared_ptr<std::thread> handle_thread_deliver_;
+  std::atomic<bool> enable_thread_deliver_;
+  std::atomic<bool> active_;
+  // callbacks in progress on any thread, waited for by deactivate
+  std::atomic<int> num_invoking_;
+  std::mutex mutex_deactivate_;
+  std::condition_variable cv_deactivate_;
+  // subscription whose callback is in progress on this thread
+  inline static thread_local const Subscription *invoking_ = nullptr;
+  std::atomic<bool> optimistic_read_;
 };
 
 class RawSubscription : public Subscription {
@@ -56,16 +339,21 @@ class RawSubscription : public Subscription {
    * @param channel channel name to subscribe
    * @param callback_msg_udpm callback function on udpm message
    * @param callback_msg_shm callback function on shm message
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
    */
   RawSubscription(
       const std::string &channel,
       const std::function<void(const std::string &, const std::shared_ptr<uint8_t> &, const size_t)>
           &callback_msg_udpm,
-      const std::function<void(const std::string &, const ShameData *)> &callback_msg_shm)
-      : Subscription(channel),
+      const std::function<void(const std::string &, const ShameData *)> &callback_msg_shm,
+      const DeliveryPolicy policy = DeliveryPolicy::kKeepAll, const size_t depth = 1)
+      : Subscription(channel, policy, depth),
         callback_msg_udpm_(callback_msg_udpm),
         callback_msg_shm_(callback_msg_shm) {}
 
+  ~RawSubscription() override { stopDelivering(); }
+
  public:
   void callbackReceiveUdpm(const std::string &channel, const std::shared_ptr<uint8_t> &data,
                            const size_t size) override {
@@ -91,19 +379,40 @@ class ProtobufSubscription : public Subscription {
    * @brief constructor of protobuf subscription
    * @param channel channel name to subscribe
    * @param callback_msg callback function on message
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
    */
   ProtobufSubscription(
       const std::string &channel,
       const std::function<void(const std::string &, const std::shared_ptr<ProtoType> &, const bool)>
-          &callback_msg)
-      : Subscription(channel), callback_msg_(callback_msg) {}
+          &callback_msg,
+      const DeliveryPolicy policy = DeliveryPolicy::kKeepAll, const size_t depth = 1)
+      : Subscription(channel, policy, depth), callback_msg_(callback_msg) {}
+
+  /**
+   * @brief constructor of protobuf subscription sharing read-only messages, message objects
+   * published in process are delivered without copy
+   * @param channel channel name to subscribe
+   * @param callback_msg callback function on message
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
+   */
+  ProtobufSubscription(const std::string &channel,
+                       const std::function<void(const std::string &,
+                                                const std::shared_ptr<const ProtoType> &,
+                                                const bool)> &callback_msg,
+                       const DeliveryPolicy policy = DeliveryPolicy::kKeepAll,
+                       const size_t depth = 1)
+      : Subscription(channel, policy, depth), callback_shared_(callback_msg) {}
+
+  ~ProtobufSubscription() override { stopDelivering(); }
 
  public:
   void callbackReceiveUdpm(const std::string &channel, const std::shared_ptr<uint8_t> &data,
                            const size_t size) override {
     auto msg = std::make_shared<ProtoType>();
     if (msg->ParseFromArray(data.get(), size)) {
-      callback_msg_(channel, msg, false);
+      callback(channel, msg, false);
     } else {
       std::cout << "Failed to parse data to type " << msg->descriptor()->full_name() << std::endl;
     }
@@ -111,19 +420,165 @@ class ProtobufSubscription : public Subscription {
 
   void callbackReceiveShm(const std::string &channel, const ShameData *shame_data) override {
     auto msg = std::make_shared<ProtoType>();
-    shame_data->mutex_.lock_sharable();
-    auto ret = msg->ParseFromArray(shame_data->data_.data(), shame_data->data_.size());
-    shame_data->mutex_.unlock_sharable();
+    bool ret = false;
+    readShm(shame_data, [&msg, &ret](const uint8_t *data, const size_t size) {
+      ret = msg->ParseFromArray(data, size);
+    });
     if (ret) {
-      callback_msg_(channel, msg, true);
+      callback(channel, msg, true);
     } else {
       std::cout << "Failed to parse data to type " << msg->descriptor()->full_name() << std::endl;
     }
   }
 
+  bool acceptsObject(const google::protobuf::MessageLite &object) const override {
+    return dynamic_cast<const ProtoType *>(&object) != nullptr;
+  }
+
+  void callbackReceiveObject(const std::string &channel,
+                             const std::shared_ptr<const google::protobuf::MessageLite> &object,
+                             const bool shared_memory) override {
+    auto msg = std::static_pointer_cast<const ProtoType>(object);
+    if (callback_shared_) {
+      callback_shared_(channel, msg, shared_memory);
+    } else {
+      // mutable messages are owned by callback
+      callback_msg_(channel, std::make_shared<ProtoType>(*msg), shared_memory);
+    }
+  }
+
+ protected:
+  /**
+   * @brief inner function to invoke callback on a parsed message
+   */
+  void callback(const std::string &channel, const std::shared_ptr<ProtoType> &msg,
+                const bool shared_memory) {
+    if (callback_shared_) {
+      callback_shared_(channel, msg, shared_memory);
+    } else {
+      callback_msg_(channel, msg, shared_memory);
+    }
+  }
+
  protected:
   const std::function<void(const std::string &, const std::shared_ptr<ProtoType> &, const bool)>
       callback_msg_;
+  const std::function<void(const std::string &, const std::shared_ptr<const ProtoType> &,
+                           const bool)>
+      callback_shared_;
+};
+
+// prefix of messages of trivially copyable structs, followed by the struct itself
+struct PodHeader {
+  // see PodSchema, 0 for unchecked
+  uint64_t schema;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+/**
+ * @brief schema hash of a trivially copyable struct carried with its messages, which only tells
+ * size and alignment apart by default, specialize hash() for a stronger check, e.g. of a hash of
+ * the definition of struct
+ */
+template <typename T>
+struct PodSchema {
+  static uint64_t hash() { return (static_cast<uint64_t>(sizeof(T)) << 32) | alignof(T); }
+};
+
+template <typename T>
+class PodSubscription : public Subscription {
+  static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+  // buffers of payloads and shared memory are aligned to 16 bytes, so is the struct after header
+  static_assert(alignof(T) <= sizeof(PodHeader), "T must not be aligned to more than 16 bytes");
+
+ public:
+  /**
+   * @brief constructor of subscription to trivially copyable struct
+   * @param channel channel name to subscribe
+   * @param callback_msg callback function on message, which refers to the received buffer or to
+   * shared memory in place, valid during callback only
+   * @param policy delivery policy for consumers slower than the publisher
+   * @param depth max number of pending messages for DeliveryPolicy::kKeepLast
+   */
+  PodSubscription(const std::string &channel,
+                  const std::function<void(const std::string &, const T &, const bool)> &callback_msg,
+                  const DeliveryPolicy policy = DeliveryPolicy::kKeepAll, const size_t depth = 1)
+      : Subscription(channel, policy, depth), callback_msg_(callback_msg), mismatched_(false) {}
+
+  ~PodSubscription() override { stopDelivering(); }
+
+ public:
+  void callbackReceiveUdpm(const std::string &channel, const std::shared_ptr<uint8_t> &data,
+                           const size_t size) override {
+    if (check(channel, data.get(), size)) {
+      callback_msg_(channel, *reinterpret_cast<const T *>(data.get() + sizeof(PodHeader)), false);
+    }
+  };
+
+  void callbackReceiveShm(const std::string &channel, const ShameData *shame_data) override {
+    if (optimistic_read_.load()) {
+      // copied out, as data in place may be overwritten during callback
+      typename std::aligned_storage<sizeof(T), alignof(T)>::type msg;
+      bool matched = false;
+      shame_data->read([&msg, &matched](const uint8_t *data, const size_t size) {
+        matched = matches(data, size);
+        if (matched) {
+          memcpy(&msg, data + sizeof(PodHeader), sizeof(T));
+        }
+      });
+      if (check(channel, matched)) {
+        callback_msg_(channel, *reinterpret_cast<const T *>(&msg), true);
+      }
+      return;
+    }
+
+    // publisher waits for callback to write the next message
+    shame_data->mutex_.lock_sharable();
+    if (check(channel, shame_data->data(), shame_data->size())) {
+      callback_msg_(channel,
+                    *reinterpret_cast<const T *>(shame_data->data() + sizeof(PodHeader)), true);
+    }
+    shame_data->mutex_.unlock_sharable();
+  }
+
+ protected:
+  /**
+   * @brief whether size and schema of message match T
+   */
+  static bool matches(const uint8_t *data, const size_t size) {
+    const uint64_t schema = PodSchema<T>::hash();
+    auto header = reinterpret_cast<const PodHeader *>(data);
+    return size == sizeof(PodHeader) + sizeof(T) && header->size == sizeof(T) &&
+           (header->schema == 0 || schema == 0 || header->schema == schema);
+  }
+
+  /**
+   * @brief check size and schema of message, mismatches are reported once
+   */
+  bool check(const std::string &channel, const uint8_t *data, const size_t size) {
+    return check(channel, matches(data, size));
+  }
+
+  /**
+   * @brief report mismatch once
+   */
+  bool check(const std::string &channel, const bool matched) {
+    if (matched) {
+      return true;
+    }
+
+    if (!mismatched_) {
+      mismatched_ = true;
+      std::cout << "Dropped messages of channel " << channel
+                << " not matching the layout of subscribed struct" << std::endl;
+    }
+    return false;
+  }
+
+ protected:
+  const std::function<void(const std::string &, const T &, const bool)> callback_msg_;
+  bool mismatched_;
 };
 
 }  // namespace shame
@@ -7,7 +7,16 @@
  */
 
 #include "shame/udpm/socket.h"
+#include <netinet/in.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+#include <algorithm>
 #include <boost/bind.hpp>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
 
 namespace ba = boost::asio;
 
@@ -16,6 +25,21 @@ namespace shame {
 static const size_t kLenIpHeader = 20;
 static const size_t kLenUdpHeader = 8;
 
+#ifdef SHAME_WITH_IO_URING
+static const unsigned kEntriesUringReceive = 64;
+static const unsigned kEntriesUringSend = 64;
+// max number of packets submitted at once, other senders wait for no longer than a batch
+static const size_t kMaxBatchSend = 32;
+// total size of buffers provided for receiving, bounded in number of buffers
+static const size_t kSizeBuffersReceive = 8 * 1024 * 1024;
+static const unsigned kMinBuffersReceive = 16;
+static const unsigned kMaxBuffersReceive = 4096;
+static const uint16_t kGroupBuffersReceive = 0;
+static const uint64_t kUserDataReceive = 1;
+static const uint64_t kUserDataCancel = 2;
+static const uint64_t kUserDataProvide = 3;
+#endif
+
 Socket::Socket(const std::string &multicast_addr, const uint16_t multicast_port, const int ttl)
     : max_len_packet_((ttl == 0 ? 65535 : 1500) - kLenIpHeader - kLenUdpHeader),
       ep_multicast_(ba::ip::address::from_string(multicast_addr), multicast_port),
@@ -24,12 +48,33 @@ Socket::Socket(const std::string &multicast_addr, const uint16_t multicast_port,
   // set TTL of send socket
   socket_send_.set_option(ba::ip::multicast::hops(ttl));
 
-  // bind receive socket to multicast port
+  // bind receive socket to multicast port of any address, so that it receives every joined group
   socket_recv_.set_option(ba::ip::udp::socket::reuse_address(true));
-  socket_recv_.bind(ep_multicast_);
+  socket_recv_.bind(ba::ip::udp::endpoint(
+      ep_multicast_.address().is_v4() ? ba::ip::address(ba::ip::address_v4::any())
+                                      : ba::ip::address(ba::ip::address_v6::any()),
+      multicast_port));
+
+#ifdef IP_MULTICAST_ALL
+  // only receive groups joined by this socket rather than by any socket of the host
+  if (ep_multicast_.address().is_v4()) {
+    int multicast_all = 0;
+    setsockopt(socket_recv_.native_handle(), IPPROTO_IP, IP_MULTICAST_ALL, &multicast_all,
+               sizeof(multicast_all));
+  }
+#endif
 
   // add receive socket to multicast group
-  socket_recv_.set_option(ba::ip::multicast::join_group(ep_multicast_.address()));
+  groups_ = std::make_shared<const std::vector<ba::ip::udp::endpoint>>(1, ep_multicast_);
+  setMembership({0});
+
+#ifdef SHAME_WITH_IO_URING
+  try {
+    uring_send_.reset(new Uring(kEntriesUringSend));
+  } catch (std::exception &e) {
+    std::cout << "Failed to send by io_uring, fall back to asio: " << e.what() << std::endl;
+  }
+#endif
 }
 
 Socket::~Socket() { stopAsyncReceiving(); }
@@ -58,12 +103,123 @@ size_t Socket::send(const std::vector<boost::asio::mutable_buffers_1> &buffers)
   return socket_send_.send_to(buffers, ep_multicast_);
 }
 
+size_t Socket::send(const std::vector<boost::asio::const_buffers_1> &buffers,
+                    const uint32_t group) {
+  return socket_send_.send_to(buffers, endpoint(group));
+}
+
+size_t Socket::send(const std::vector<std::array<boost::asio::const_buffer, 2>> &packets,
+                    const uint32_t group) {
+  // resolved once for all fragments
+  const ba::ip::udp::endpoint ep = endpoint(group);
+
+#ifdef SHAME_WITH_IO_URING
+  if (uring_send_) {
+    return sendUring(packets, ep);
+  }
+#endif
+
+  size_t len = 0;
+  for (const auto &packet : packets) {
+    len += socket_send_.send_to(packet, ep);
+  }
+  return len;
+}
+
+uint32_t Socket::addGroup(const std::string &multicast_addr) {
+  const ba::ip::udp::endpoint ep(ba::ip::address::from_string(multicast_addr),
+                                 ep_multicast_.port());
+  std::lock_guard<std::mutex> lock(mutex_groups_);
+  auto it = std::find(groups_->begin(), groups_->end(), ep);
+  if (it != groups_->end()) {
+    return it - groups_->begin();
+  }
+  auto groups = std::make_shared<std::vector<ba::ip::udp::endpoint>>(*groups_);
+  groups->push_back(ep);
+  std::atomic_store(&groups_, std::shared_ptr<const std::vector<ba::ip::udp::endpoint>>(groups));
+  return groups->size() - 1;
+}
+
+uint32_t Socket::addGroup(const uint32_t offset) {
+  ba::ip::address addr;
+  if (ep_multicast_.address().is_v4()) {
+    addr = ba::ip::address_v4(ep_multicast_.address().to_v4().to_ulong() + offset);
+  } else {
+    auto bytes = ep_multicast_.address().to_v6().to_bytes();
+    uint32_t carry = offset;
+    for (auto it = bytes.rbegin(); it != bytes.rend() && carry; ++it) {
+      carry += *it;
+      *it = carry & 0xff;
+      carry >>= 8;
+    }
+    addr = ba::ip::address_v6(bytes);
+  }
+  return addGroup(addr.to_string());
+}
+
+ba::ip::udp::endpoint Socket::endpoint(const uint32_t group) const {
+  const auto groups = std::atomic_load(&groups_);
+  return (group < groups->size() ? (*groups)[group] : ep_multicast_);
+}
+
+void Socket::setMembership(const std::set<uint32_t> &groups) {
+  std::lock_guard<std::mutex> lock(mutex_groups_);
+  const auto &endpoints = *groups_;
+  for (auto group : joined_) {
+    if (!groups.count(group)) {
+      socket_recv_.set_option(ba::ip::multicast::leave_group(endpoints[group].address()));
+    }
+  }
+  for (auto group : groups) {
+    if (group < endpoints.size() && !joined_.count(group)) {
+      socket_recv_.set_option(ba::ip::multicast::join_group(endpoints[group].address()));
+    }
+  }
+  joined_.clear();
+  for (auto group : groups) {
+    if (group < endpoints.size()) {
+      joined_.insert(group);
+    }
+  }
+}
+
+bool Socket::setFilter(const void *filter, const size_t num_instructions) {
+#ifdef __linux__
+  const int fd = socket_recv_.native_handle();
+  if (!filter) {
+    int dummy = 0;
+    setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy));
+    return true;
+  }
+
+  sock_fprog program;
+  program.len = num_instructions;
+  program.filter = const_cast<sock_filter *>(reinterpret_cast<const sock_filter *>(filter));
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == 0;
+#else
+  (void)filter;
+  (void)num_instructions;
+  return false;
+#endif
+}
+
+size_t Socket::receive(void *buffer, const size_t size) {
+  const auto len = recv(socket_recv_.native_handle(), buffer, size, MSG_DONTWAIT);
+  return (len > 0 ? len : 0);
+}
+
 void Socket::startAsyncReceiving(
     const std::function<void(const std::shared_ptr<uint8_t> &, const size_t)> &callback_recv) {
   callback_recv_ = callback_recv;
   stopAsyncReceiving();
 
   enable_thread_receive_.store(true);
+#ifdef SHAME_WITH_IO_URING
+  if (startReceivingUring()) {
+    handle_thread_receive_.reset(new std::thread(&Socket::threadReceiveUring, this));
+    return;
+  }
+#endif
   handle_thread_receive_.reset(new std::thread(&Socket::threadReceive, this));
 }
 
@@ -71,6 +227,24 @@ void Socket::stopAsyncReceiving() {
   // break from ThreadReceive
   enable_thread_receive_.store(false);
   ios_.stop();
+#ifdef SHAME_WITH_IO_URING
+  // multishot receive is cancelled, which wakes the receiving thread, which drains completions
+  // until its final one, receive is never armed again once stopped
+  if (uring_recv_) {
+    std::lock_guard<std::mutex> lock(mutex_uring_recv_);
+    auto sqe = uring_recv_->sqe();
+    if (!sqe) {
+      uring_recv_->submit();
+      sqe = uring_recv_->sqe();
+    }
+    if (sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = kUserDataReceive;
+      sqe->user_data = kUserDataCancel;
+    }
+    uring_recv_->submit();
+  }
+#endif
 
   // join ThreadReceive
   if (handle_thread_receive_) {
@@ -78,6 +252,12 @@ void Socket::stopAsyncReceiving() {
     handle_thread_receive_.reset();
   }
 
+#ifdef SHAME_WITH_IO_URING
+  // kernel no longer writes to buffers, those still lent keep their pool until released
+  uring_recv_.reset();
+  buffer_pool_.reset();
+#endif
+
   // reset io_service to normal status
   ios_.reset();
 }
@@ -111,4 +291,176 @@ void Socket::callbackReceive(const std::shared_ptr<uint8_t> &data, const size_t
                   ba::placeholders::error()));
 }
 
+#ifdef SHAME_WITH_IO_URING
+bool Socket::startReceivingUring() {
+  const unsigned num_buffers = std::max(
+      kMinBuffersReceive,
+      std::min<unsigned>(kMaxBuffersReceive, kSizeBuffersReceive / max_len_packet_));
+
+  try {
+    uring_recv_.reset(new Uring(kEntriesUringReceive));
+  } catch (std::exception &e) {
+    std::cout << "Failed to receive by io_uring, fall back to asio: " << e.what() << std::endl;
+    return false;
+  }
+  buffer_pool_ = std::make_shared<BufferPool>(num_buffers, max_len_packet_);
+  return true;
+}
+
+bool Socket::refillReceiveUring(const bool arm) {
+  buffer_pool_->reclaim(&ids_provide_);
+  if (ids_provide_.empty() && !arm) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_uring_recv_);
+  // checked under the lock of stopping, which cancels receive armed before
+  const bool armed = arm && enable_thread_receive_.load();
+  auto next = [this]() {
+    auto sqe = uring_recv_->sqe();
+    if (!sqe) {
+      uring_recv_->submit();
+      sqe = uring_recv_->sqe();
+    }
+    return sqe;
+  };
+
+  // buffers of consecutive ids are provided at once
+  for (size_t begin = 0, end = 0; begin < ids_provide_.size(); begin = end) {
+    end = begin + 1;
+    while (end < ids_provide_.size() && ids_provide_[end] == ids_provide_[end - 1] + 1) {
+      ++end;
+    }
+
+    auto sqe = next();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = end - begin;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer_pool_->buffer(ids_provide_[begin]));
+    sqe->len = buffer_pool_->lengthOfBuffer();
+    sqe->off = ids_provide_[begin];
+    sqe->buf_group = kGroupBuffersReceive;
+    sqe->user_data = kUserDataProvide;
+  }
+
+  if (armed) {
+    // receives until an error, e.g. running out of buffers
+    auto sqe = next();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket_recv_.native_handle();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kGroupBuffersReceive;
+    sqe->user_data = kUserDataReceive;
+  }
+  uring_recv_->submit();
+  return armed;
+}
+
+void Socket::threadReceiveUring() {
+  bool armed = false;
+  bool failed = false;
+  // once stopped, completions are drained until the final one of receive, after which kernel no
+  // longer writes to buffers of the pool
+  while (!failed && (enable_thread_receive_.load() || armed)) {
+    const bool enabled = enable_thread_receive_.load();
+    if (enabled) {
+      armed = refillReceiveUring(!armed) || armed;
+    }
+    uring_recv_->wait(1);
+
+    io_uring_cqe *cqe;
+    while ((cqe = uring_recv_->peek())) {
+      if (cqe->user_data == kUserDataReceive) {
+        if (enabled && cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+          const uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+          callback_recv_(buffer_pool_->take(id, cqe->res), cqe->res);
+        }
+        // running out of buffers is recovered by providing returned ones again
+        if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+          std::cout << "Failed to receive by io_uring, fall back to asio: " << strerror(-cqe->res)
+                    << std::endl;
+          failed = true;
+        }
+        armed &= static_cast<bool>(cqe->flags & IORING_CQE_F_MORE);
+      }
+      uring_recv_->advance();
+    }
+  }
+
+  // e.g. multishot receiving unsupported by kernel
+  if (failed) {
+    threadReceive();
+  }
+}
+
+size_t Socket::sendUring(const std::vector<std::array<boost::asio::const_buffer, 2>> &packets,
+                         const boost::asio::ip::udp::endpoint &ep) {
+  size_t len = 0;
+  for (size_t begin = 0; begin < packets.size(); begin += kMaxBatchSend) {
+    const size_t num = std::min(kMaxBatchSend, packets.size() - begin);
+
+    std::lock_guard<std::mutex> lock(mutex_uring_send_);
+    msgs_send_.resize(num);
+    iovs_send_.resize(num * 2);
+    for (size_t i = 0; i < num; ++i) {
+      const auto &packet = packets[begin + i];
+      for (size_t j = 0; j < 2; ++j) {
+        iovs_send_[i * 2 + j].iov_base = const_cast<void *>(packet[j].data());
+        iovs_send_[i * 2 + j].iov_len = packet[j].size();
+      }
+
+      msghdr &msg = msgs_send_[i];
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = const_cast<sockaddr *>(ep.data());
+      msg.msg_namelen = ep.size();
+      msg.msg_iov = &iovs_send_[i * 2];
+      msg.msg_iovlen = 2;
+
+      auto sqe = uring_send_->sqe();
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = socket_send_.native_handle();
+      sqe->addr = reinterpret_cast<uint64_t>(&msg);
+      sqe->len = 1;
+    }
+
+    // a single system call for the whole batch, unless kernel consumes part of it, entries never
+    // consumed are withdrawn, so that only completions of those consumed are waited for
+    size_t num_submitted = 0;
+    int error = 0;
+    while (num_submitted < num) {
+      const int ret = uring_send_->submit(num_submitted == 0 ? num : 0);
+      if (ret == -EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        error = (ret < 0 ? -ret : EAGAIN);
+        uring_send_->rollback();
+        break;
+      }
+      num_submitted += ret;
+    }
+
+    for (size_t num_completed = 0; num_completed < num_submitted;) {
+      io_uring_cqe *cqe = uring_send_->peek();
+      if (!cqe) {
+        uring_send_->wait(1);
+        continue;
+      }
+      if (cqe->res < 0) {
+        error = -cqe->res;
+      } else {
+        len += cqe->res;
+      }
+      uring_send_->advance();
+      ++num_completed;
+    }
+    if (error) {
+      throw boost::system::system_error(boost::system::error_code(error, boost::system::system_category()),
+                                        num_submitted < num ? "io_uring_enter" : "sendmsg");
+    }
+  }
+  return len;
+}
+#endif
+
 }  // namespace shame
@@ -8,14 +8,18 @@
 
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <boost/asio.hpp>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 #include <vector>
+#include "shame/udpm/uring.h"
 
 namespace shame {
 
@@ -78,6 +82,58 @@ class Socket {
    */
   size_t send(const std::vector<boost::asio::mutable_buffers_1> &buffers);
 
+  /**
+   * @brief send boost const buffers to a multicast group
+   * @param buffer boost const buffers
+   * @param group index of group returned by addGroup
+   * @return bytes transfered
+   */
+  size_t send(const std::vector<boost::asio::const_buffers_1> &buffers, const uint32_t group);
+
+  /**
+   * @brief send packets to a multicast group, submitted in batches by io_uring if built with
+   * SHAME_WITH_IO_URING and supported by kernel, packets may leave out of order then
+   * @param packets packets, each of header and payload
+   * @param group index of group returned by addGroup
+   * @return bytes transfered of all packets
+   */
+  size_t send(const std::vector<std::array<boost::asio::const_buffer, 2>> &packets,
+              const uint32_t group);
+
+  /**
+   * @brief register a multicast group on the same port, group 0 is the one of constructor
+   * @param multicast_addr address of udpm multicast
+   * @return index of group
+   */
+  uint32_t addGroup(const std::string &multicast_addr);
+
+  /**
+   * @brief register the multicast group at the address of group 0 plus offset
+   * @param offset offset of address
+   * @return index of group
+   */
+  uint32_t addGroup(const uint32_t offset);
+
+  /**
+   * @brief resolve multicast group, group 0 if unknown
+   * @param group index of group returned by addGroup
+   */
+  boost::asio::ip::udp::endpoint endpoint(const uint32_t group) const;
+
+  /**
+   * @brief join exactly the given groups for receiving, leaving all others
+   * @param groups indexes of groups returned by addGroup
+   */
+  void setMembership(const std::set<uint32_t> &groups);
+
+  /**
+   * @brief install classic BPF program dropping packets in kernel before receiving, Linux only
+   * @param filter array of struct sock_filter, nullptr to remove filter
+   * @param num_instructions length of array
+   * @return true on success
+   */
+  bool setFilter(const void *filter, const size_t num_instructions);
+
   /**
    * @brief start async receiving
    * @param callback_recv callback function on receiving
@@ -90,6 +146,19 @@ class Socket {
    */
   void stopAsyncReceiving();
 
+  /**
+   * @brief receive a pending packet without blocking, for polling without receiving thread
+   * @param buffer buffer of max length of packet
+   * @param size size of buffer
+   * @return length of packet, 0 if none pending
+   */
+  size_t receive(void *buffer, const size_t size);
+
+  /**
+   * @brief get file descriptor of receive socket, readable when packets are pending
+   */
+  int fd() { return socket_recv_.native_handle(); }
+
   /**
    * @brief get max length of single packet
    * @return max length of single packet in bytes
@@ -108,17 +177,61 @@ class Socket {
   void callbackReceive(const std::shared_ptr<uint8_t> &data, const size_t size,
                        const boost::system::error_code ec);
 
+#ifdef SHAME_WITH_IO_URING
+  /**
+   * @brief inner function to set up receiving by io_uring
+   * @return false if unsupported, to fall back to asio
+   */
+  bool startReceivingUring();
+
+  /**
+   * @brief inner function to provide buffers returned to buffer_pool_ again, and submit multishot
+   * receive into them if arm
+   * @return whether receive armed, never once stopping
+   */
+  bool refillReceiveUring(const bool arm);
+
+  /**
+   * @brief inner thread to handle completions of receiving by io_uring, continues as threadReceive
+   * if receiving fails
+   */
+  void threadReceiveUring();
+
+  /**
+   * @brief inner function to send packets in batches by io_uring
+   */
+  size_t sendUring(const std::vector<std::array<boost::asio::const_buffer, 2>> &packets,
+                   const boost::asio::ip::udp::endpoint &ep);
+#endif
+
  protected:
   const size_t max_len_packet_;
 
   boost::asio::io_service ios_;
   boost::asio::ip::udp::endpoint ep_multicast_;
+  // copy-on-write, so that sending resolves groups without lock, written under mutex_groups_
+  std::shared_ptr<const std::vector<boost::asio::ip::udp::endpoint>> groups_;
+  std::set<uint32_t> joined_;
+  std::mutex mutex_groups_;
   boost::asio::ip::udp::socket socket_send_;
   boost::asio::ip::udp::socket socket_recv_;
 
   std::function<void(const std::shared_ptr<uint8_t> &, const size_t)> callback_recv_;
   std::shared_ptr<std::thread> handle_thread_receive_;
   std::atomic<bool> enable_thread_receive_;
+
+#ifdef SHAME_WITH_IO_URING
+  // ring of receiving, entries are got from the receiving thread and on stopping
+  std::unique_ptr<Uring> uring_recv_;
+  std::shared_ptr<BufferPool> buffer_pool_;
+  std::vector<uint16_t> ids_provide_;
+  std::mutex mutex_uring_recv_;
+  // ring of sending, null if unsupported, and messages of a batch reused for every batch
+  std::unique_ptr<Uring> uring_send_;
+  std::vector<msghdr> msgs_send_;
+  std::vector<iovec> iovs_send_;
+  std::mutex mutex_uring_send_;
+#endif
 };
 
 }  // namespace shame
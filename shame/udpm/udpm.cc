@@ -7,38 +7,176 @@
  */
 
 #include "shame/udpm/udpm.h"
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#endif
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <tuple>
 #include <vector>
+#include "shame/common/copy.h"
+#include "shame/common/hash.h"
+#include "shame/common/pattern.h"
 #include "shame/common/thread_safe_queue.h"
+#include "shame/common/time.h"
 #include "shame/udpm/socket.h"
 
 namespace shame {
 
+static const size_t kLenUdpHeader = 8;
+static const size_t kCapacityPacketQueue = 8192;
+static const size_t kMaxIncompleteMessages = 256;
+// interval in microseconds of announcing names of channels being published
+static const uint64_t kIntervalAnnounce = 1000000;
+// min interval in microseconds of querying name of an unresolved channel
+static const uint64_t kIntervalQuery = 100000;
+// interests of peers not announced again within this period in microseconds are forgotten
+static const uint64_t kTimeoutInterest = 10000000;
+// period in microseconds of receiving after first announcement of a channel, by the end of which
+// every subscriber has announced its interest
+static const uint64_t kWarmUpDiscovery = 2 * kIntervalAnnounce;
+// max number of packets kept until their channels are resolved
+static const size_t kMaxUnresolvedPackets = 1024;
+// packets of a channel not resolved within this period in microseconds are dropped, its
+// publishers are gone
+static const uint64_t kTimeoutUnresolved = 2 * kIntervalAnnounce;
+
+/**
+ * @brief get id of this host, which tells processes on the same host apart from others
+ */
+static uint64_t hostId() {
+  char name[256] = {0};
+  gethostname(name, sizeof(name) - 1);
+  std::string id(name);
+
+  // hosts which happen to share a name are told apart by boot of their kernels, containers on the
+  // same machine share boot_id, and are told apart by their host names only
+  std::ifstream file("/proc/sys/kernel/random/boot_id");
+  std::string boot_id;
+  std::getline(file, boot_id);
+  id += boot_id;
+  return channelId(id);
+}
+
 Udpm::Udpm(const std::string &multicast_addr, const uint16_t multicast_port, const int ttl)
     : signature_udpm_message_(0x19651116),
       signature_shm_message_(0x19691125),
+      signature_batch_message_(0x19920303),
+      signature_announce_message_(0x19870422),
+      signature_query_message_(0x19900607),
+      signature_interest_message_(0x19931226),
       socket_(new Socket(multicast_addr, multicast_port, ttl)),
-      msg_queue_(new ThreadSafeQueue<std::pair<std::shared_ptr<uint8_t>, size_t>>()),
+      msg_queue_(new ThreadSafeQueue<std::pair<std::shared_ptr<uint8_t>, size_t>>(
+          kCapacityPacketQueue, OverflowPolicy::kDropNewest)),
+      max_msg_buffer_(kMaxIncompleteMessages),
+      size_msg_buffer_(0),
+      num_dropped_msg_buffer_(0),
+      listeners_(std::make_shared<std::vector<Listener>>()),
+      next_listener_(0),
+      num_receivers_(0),
+      enable_thread_pack_(false),
+      t_receiving_(0),
       e_(std::random_device{}()),
-      d_(0, 0xffffffff) {}
+      d_(0, 0xffffffff),
+      source_(d_(e_)),
+      host_(hostId()),
+      generation_interests_(0),
+      t_announce_interests_(0),
+      num_unresolved_(0),
+      hashed_groups_(1, 0),
+      group_batch_(0),
+      max_len_batch_(0),
+      max_delay_batch_(0),
+      deadline_batch_(0),
+      enable_thread_flush_(false) {}
+
+Udpm::~Udpm() {
+  stopReceiving();
+  disableBatching();
+
+  std::lock_guard<std::mutex> lock(mutex_groups_);
+  for (const auto &item : patterns_) {
+    announceInterest(item.first.first, item.first.second, true);
+  }
+}
+
+std::shared_ptr<Udpm> Udpm::instance(const std::string &multicast_addr,
+                                     const uint16_t multicast_port, const int ttl) {
+  static std::mutex mutex;
+  static std::map<std::tuple<std::string, uint16_t, int>, std::weak_ptr<Udpm>> instances;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &item = instances[std::make_tuple(multicast_addr, multicast_port, ttl)];
+  auto udpm = item.lock();
+  if (!udpm) {
+    udpm.reset(new Udpm(multicast_addr, multicast_port, ttl));
+    item = udpm;
+  }
+  return udpm;
+}
+
+uint64_t Udpm::addListener(const Callback &callback_recv, const LocalCallback &callback_local,
+                           const uint64_t segment) {
+  std::lock_guard<std::mutex> lock(mutex_listeners_);
+  auto listeners = std::make_shared<std::vector<Listener>>(*listeners_);
+  listeners->push_back(
+      {++next_listener_, callback_recv, callback_local, segment, std::make_shared<Calls>()});
+  listeners_ = listeners;
+  return next_listener_;
+}
 
-Udpm::~Udpm() { stopAsyncReceiving(); }
+void Udpm::removeListener(const uint64_t id) {
+  std::unique_lock<std::mutex> lock(mutex_listeners_);
+  auto listeners = std::make_shared<std::vector<Listener>>(*listeners_);
+  auto it = std::find_if(listeners->begin(), listeners->end(),
+                         [id](const Listener &item) { return item.id == id; });
+  if (it == listeners->end()) {
+    return;
+  }
+  auto calls = it->calls;
+  listeners->erase(it);
+  listeners_ = listeners;
+
+  // calls started before are waited for, except the one removing itself on this thread
+  calls->removed.store(true);
+  const int num_self = (calling_ == calls.get() ? 1 : 0);
+  cv_listeners_.wait(lock, [&]() { return calls->num.load() <= num_self; });
+}
+
+void Udpm::startAsyncReceiving() {
+  std::lock_guard<std::mutex> lock(mutex_receivers_);
+  if (num_receivers_++ > 0) {
+    return;
+  }
 
-void Udpm::startAsyncReceiving(
-    const std::function<void(const std::string &, const std::shared_ptr<uint8_t> &, const size_t,
-                             const bool)> &callback_recv) {
-  stopAsyncReceiving();
-  callback_recv_ = callback_recv;
   msg_queue_->clear();
   msg_queue_->reset();
 
+  // packets being received on a caller thread are handled before the packing thread starts
+  std::lock_guard<std::mutex> lock_receive(mutex_receive_);
   enable_thread_pack_.store(true);
   handle_thread_pack_.reset(new std::thread(std::bind(&Udpm::threadPack, this)));
 
   socket_->startAsyncReceiving(
       std::bind(&Udpm::callbackReceive, this, std::placeholders::_1, std::placeholders::_2));
+  t_receiving_.store(nowMonotonic());
 }
 
 void Udpm::stopAsyncReceiving() {
+  std::lock_guard<std::mutex> lock(mutex_receivers_);
+  if (num_receivers_ == 0 || --num_receivers_ > 0) {
+    return;
+  }
+  stopReceiving();
+}
+
+void Udpm::stopReceiving() {
+  t_receiving_.store(0);
   socket_->stopAsyncReceiving();
 
   enable_thread_pack_.store(false);
@@ -50,45 +188,196 @@ void Udpm::stopAsyncReceiving() {
   }
 }
 
+template <typename F>
+void Udpm::forEachListener(F f) {
+  std::shared_ptr<const std::vector<Listener>> listeners;
+  {
+    std::lock_guard<std::mutex> lock(mutex_listeners_);
+    listeners = listeners_;
+  }
+  for (const auto &item : *listeners) {
+    // counted before checking removed, while removeListener marks removed before checking count,
+    // so that either this call is skipped or waited for
+    auto &calls = *item.calls;
+    calls.num.fetch_add(1);
+    if (!calls.removed.load()) {
+      const Calls *previous = calling_;
+      calling_ = &calls;
+      f(item);
+      calling_ = previous;
+    }
+    if (calls.num.fetch_sub(1) == 1 && calls.removed.load()) {
+      std::lock_guard<std::mutex> lock(mutex_listeners_);
+      cv_listeners_.notify_all();
+    }
+  }
+}
+
+void Udpm::notify(const Header &header, const std::string &channel,
+                  const std::shared_ptr<uint8_t> &payload) {
+  const bool shared_memory = (header.signature == signature_shm_message_);
+  const bool urgent = (header.flags & kFlagUrgent);
+  forEachListener([&](const Listener &item) {
+    if (accepts(header, item.segment)) {
+      item.callback_recv(channel, payload, header.len_payload, shared_memory, urgent);
+    }
+  });
+}
+
+bool Udpm::accepted(const Header &header) {
+  std::lock_guard<std::mutex> lock(mutex_listeners_);
+  for (const auto &item : *listeners_) {
+    if (accepts(header, item.segment)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Udpm::sendLocal(Publication *publication,
+                     const std::shared_ptr<const google::protobuf::MessageLite> &msg,
+                     const bool shared_memory) {
+  bool urgent;
+  {
+    std::lock_guard<std::mutex> lock(mutex_send_);
+    urgent = publication->urgent;
+  }
+
+  bool delivered = false;
+  forEachListener([&](const Listener &item) {
+    item.callback_local(publication->name, msg, shared_memory, urgent);
+    delivered = true;
+  });
+  return delivered;
+}
+
+size_t Udpm::receive(const size_t max_packets) {
+  std::lock_guard<std::mutex> lock(mutex_receive_);
+  if (enable_thread_pack_.load()) {
+    return 0;
+  }
+
+  buffer_receive_.resize(socket_->maxLengthOfPacket());
+  size_t num = 0;
+  while (max_packets == 0 || num < max_packets) {
+    const auto size = socket_->receive(buffer_receive_.data(), buffer_receive_.size());
+    if (size == 0) {
+      break;
+    }
+    handlePacket(buffer_receive_.data(), size);
+    ++num;
+  }
+  return num;
+}
+
+int Udpm::fd() { return socket_->fd(); }
+
 size_t Udpm::send(const std::string &channel, const void *payload, const size_t len_payload,
-                  const bool shared_memory) {
+                  const bool shared_memory, const bool delivered_locally) {
+  return send(publication(channel), payload, len_payload, shared_memory, delivered_locally);
+}
+
+Publication *Udpm::publication(const std::string &channel, const uint64_t segment) {
+  std::lock_guard<std::mutex> lock(mutex_send_);
+  auto it = publications_.find(channel);
+  if (it == publications_.end()) {
+    const auto id = channelId(channel);
+    std::lock_guard<std::mutex> lock_groups(mutex_groups_);
+    // announced on first message
+    it = publications_.emplace(std::piecewise_construct, std::forward_as_tuple(channel),
+                               std::forward_as_tuple())
+             .first;
+    it->second.name = channel;
+    it->second.id = id;
+    it->second.group = group(channel, id);
+    published_names_[id] = channel;
+  }
+  if (segment != 0) {
+    it->second.segment = segment;
+  }
+  return &it->second;
+}
+
+size_t Udpm::send(Publication *publication, const void *payload, const size_t len_payload,
+                  const bool shared_memory, const bool delivered_locally, const bool mirrored) {
   Header header;
   header.signature = (shared_memory ? signature_shm_message_ : signature_udpm_message_);
-  header.id = d_(e_);
+  header.version = kVersionHeader;
+  header.flags = (delivered_locally ? kFlagDeliveredLocally : 0) | (mirrored ? kFlagMirrored : 0);
+  header.source = source_;
   header.len_payload = len_payload;
+  header.timestamp = nowMonotonic();
+
+  bool need_announce = false;
+  uint32_t group_channel = 0;
+  bool urgent = false;
+  uint64_t segment = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_send_);
+    header.id = d_(e_);
+    header.channel = publication->id;
+    header.seq = publication->seq++;
+    group_channel = publication->group;
+    urgent = publication->urgent;
+    segment = publication->segment;
 
-  if (sizeof(Header) + channel.size() + 1 + len_payload <= socket_->maxLengthOfPacket()) {
+    need_announce = dueAnnounce(publication, header.timestamp);
+  }
+  if (need_announce) {
+    announce(header.channel, publication->name, segment);
+  }
+
+  if (sizeof(Header) + len_payload <= socket_->maxLengthOfPacket()) {
     header.num_packets = 1;
     header.offset = 0;
-    return send(header, channel, payload, len_payload) - sizeof(Header) - channel.size() - 1;
+    if (urgent) {
+      header.flags |= kFlagUrgent;
+    } else if (batch(header, group_channel, payload, len_payload)) {
+      return len_payload;
+    }
+    return send(header, group_channel, payload, len_payload) - sizeof(Header);
   } else {
-    const size_t max_len_payload_per_packet =
-        socket_->maxLengthOfPacket() - sizeof(Header) - channel.size() - 1;
+    // keep order of messages batched before, which urgent messages overtake
+    if (urgent) {
+      header.flags |= kFlagUrgent;
+    } else {
+      std::lock_guard<std::mutex> lock(mutex_batch_);
+      flushBatch();
+    }
+
+    const size_t max_len_payload_per_packet = socket_->maxLengthOfPacket() - sizeof(Header);
     uint32_t num_packets = len_payload / max_len_payload_per_packet;
     if (num_packets * max_len_payload_per_packet < len_payload) {
       ++num_packets;
     }
 
     header.num_packets = num_packets;
-    header.offset = 0;
 
-    size_t len_sent_payload = 0;
-    for (uint32_t packet_no = 0; packet_no < num_packets - 1; ++packet_no) {
-      len_sent_payload += send(header, channel, (const uint8_t *)payload + header.offset,
-                               max_len_payload_per_packet) -
-                          sizeof(Header) - channel.size() - 1;
-      header.offset += max_len_payload_per_packet;
+    // all fragments are handed to socket at once, which may send them in a single system call
+    std::vector<Header> headers(num_packets, header);
+    std::vector<std::array<boost::asio::const_buffer, 2>> packets(num_packets);
+    for (uint32_t packet_no = 0; packet_no < num_packets; ++packet_no) {
+      Header &header_packet = headers[packet_no];
+      header_packet.offset = packet_no * max_len_payload_per_packet;
+      packets[packet_no][0] = boost::asio::buffer(&header_packet, sizeof(Header));
+      packets[packet_no][1] =
+          boost::asio::buffer((const uint8_t *)payload + header_packet.offset,
+                              std::min(max_len_payload_per_packet, len_payload - header_packet.offset));
     }
-
-    len_sent_payload += send(header, channel, (const uint8_t *)payload + header.offset,
-                             len_payload - header.offset) -
-                        sizeof(Header) - channel.size() - 1;
-    return len_sent_payload;
+    return socket_->send(packets, group_channel) - num_packets * sizeof(Header);
   }
 }
 
 void Udpm::callbackReceive(const std::shared_ptr<uint8_t> &data, const size_t size) {
-  msg_queue_->enqueue(std::make_pair(data, size));
+  // control packets, e.g. names of channels, overtake messages as well, which may depend on them
+  bool urgent = false;
+  if (size >= sizeof(Header)) {
+    auto header = reinterpret_cast<const Header *>(data.get());
+    urgent = (header->flags & kFlagUrgent) || (header->signature != signature_udpm_message_ &&
+                                               header->signature != signature_shm_message_ &&
+                                               header->signature != signature_batch_message_);
+  }
+  msg_queue_->enqueue(std::make_pair(data, size), urgent);
 }
 
 void Udpm::threadPack() {
@@ -98,47 +387,696 @@ void Udpm::threadPack() {
       continue;
     }
 
-    auto p = packet.first.get();
-    auto header = reinterpret_cast<Header *>(p);
-    std::string channel(reinterpret_cast<char *>(p) + sizeof(Header));
-    auto data = p + sizeof(Header) + channel.size() + 1;
+    handlePacket(packet.first.get(), packet.second);
+  }
+}
+
+void Udpm::handlePacket(const uint8_t *p, const size_t size) {
+  if (size < sizeof(Header)) {
+    return;
+  }
+
+  auto header = reinterpret_cast<const Header *>(p);
+  if (header->version != kVersionHeader) {
+    return;
+  }
+  if ((header->flags & kFlagDeliveredLocally) && header->source == source_) {
+    return;
+  }
+
+  auto data = p + sizeof(Header);
+  const size_t len_data = size - sizeof(Header);
+
+  if (header->signature == signature_batch_message_) {
+    // packets of batch, each prefixed by its length
+    auto q = data;
+    while (static_cast<size_t>(data + len_data - q) >= sizeof(uint32_t)) {
+      uint32_t len;
+      memcpy(&len, q, sizeof(len));
+      q += sizeof(len);
+      if (len > static_cast<size_t>(data + len_data - q)) {
+        break;
+      }
+      handlePacket(q, len);
+      q += len;
+    }
+    return;
+  } else if (header->signature == signature_announce_message_) {
+    if (len_data < sizeof(Peer)) {
+      return;
+    }
+    memcpy(&peers_[std::make_pair(header->source, header->channel)], data, sizeof(Peer));
+    auto &name = channel_names_[header->channel];
+    const bool resolved = !name.empty();
+    name.assign(reinterpret_cast<const char *>(data + sizeof(Peer)), len_data - sizeof(Peer));
+
+    // a new publisher learns subscribers right away
+    announceInterests(!resolved);
+
+    // packets received before the name are handled now
+    auto it = unresolved_.find(header->channel);
+    if (it != unresolved_.end()) {
+      auto packets = std::move(it->second.packets);
+      unresolved_.erase(it);
+      num_parked_ -= packets.size();
+      for (const auto &packet : packets) {
+        handlePacket(packet.data(), packet.size());
+      }
+    }
+    return;
+  } else if (header->signature == signature_interest_message_) {
+    handleInterest(*header, data, len_data);
+    return;
+  } else if (header->signature == signature_query_message_) {
+    std::string channel;
+    uint64_t segment = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_send_);
+      auto it = published_names_.find(header->channel);
+      if (it != published_names_.end()) {
+        channel = it->second;
+        segment = publications_[channel].segment;
+      }
+    }
+    // receivers answer as well, so that publishers not receiving do not keep others waiting for
+    // their next announcement, at most once per interval of queries each
+    if (channel.empty()) {
+      auto it = channel_names_.find(header->channel);
+      if (it == channel_names_.end()) {
+        return;
+      }
+      const auto t = nowMonotonic();
+      auto &t_answer = queries_[header->channel];
+      if (t_answer != 0 && t - t_answer < kIntervalQuery) {
+        return;
+      }
+      t_answer = t;
+      channel = it->second;
+    }
+    announce(header->channel, channel, segment);
+    return;
+  }
+
+  auto it_channel = channel_names_.find(header->channel);
+  if (it_channel == channel_names_.end()) {
+    park(*header, p, size);
+    query(header->channel);
+    return;
+  }
+  const std::string &channel = it_channel->second;
+
+  if (header->num_packets == 1) {
+    if (header->len_payload > len_data || !accepted(*header)) {
+      return;
+    }
+    std::shared_ptr<uint8_t> payload(new uint8_t[header->len_payload],
+                                     std::default_delete<uint8_t[]>());
+    copy(payload.get(), data, header->len_payload);
+    updateStatistics(*header, channel);
+    notify(*header, channel, payload);
+  } else {
+    const uint64_t key = (static_cast<uint64_t>(header->source) << 32) | header->id;
+    auto it = msg_buffer_.find(key);
+    if (it != msg_buffer_.end()) {
+      // fragments of another message colliding on source and id, or forged ones, are dropped
+      const Header &stored = it->second.header;
+      if (header->num_packets != stored.num_packets ||
+          header->len_payload != stored.len_payload || header->channel != stored.channel) {
+        return;
+      }
+    } else {
+      if (!accepted(*header)) {
+        return;
+      }
+
+      // drop the oldest incomplete message, its fragments are most likely lost
+      while (!msg_buffer_.empty() && msg_buffer_.size() >= max_msg_buffer_.load()) {
+        auto oldest = std::min_element(
+            msg_buffer_.begin(), msg_buffer_.end(),
+            [](const std::pair<const uint64_t, MessageBuffer> &a,
+               const std::pair<const uint64_t, MessageBuffer> &b) {
+              return a.second.header.timestamp < b.second.header.timestamp;
+            });
+        msg_buffer_.erase(oldest);
+        num_dropped_msg_buffer_.fetch_add(1);
+      }
+
+      MessageBuffer buffer;
+      buffer.header = *header;
+      buffer.channel = &channel;
+      buffer.num_received = 0;
+      buffer.payload.reset(new uint8_t[header->len_payload], std::default_delete<uint8_t[]>());
+      it = msg_buffer_.emplace(key, buffer).first;
+    }
+
+    // bounded by the buffer allocated, not by what the fragment declares
+    const uint32_t len_payload = it->second.header.len_payload;
+    if (header->offset > len_payload || len_data > len_payload - header->offset) {
+      return;
+    }
+    copy(it->second.payload.get() + header->offset, data, len_data, len_payload);
+    if (++it->second.num_received == it->second.header.num_packets) {
+      updateStatistics(it->second.header, *it->second.channel);
+      notify(it->second.header, *it->second.channel, it->second.payload);
+      msg_buffer_.erase(it);
+    }
+    size_msg_buffer_.store(msg_buffer_.size());
+  }
+}
+
+void Udpm::enableBatching(const size_t max_len_batch, const uint64_t max_delay) {
+  disableBatching();
+
+  std::lock_guard<std::mutex> lock(mutex_batch_);
+  max_len_batch_ = std::min(max_len_batch, socket_->maxLengthOfPacket());
+  max_delay_batch_ = max_delay;
+  batch_.reserve(max_len_batch_);
+  batch_.clear();
+  enable_thread_flush_ = true;
+  handle_thread_flush_.reset(new std::thread(&Udpm::threadFlush, this));
+}
+
+void Udpm::disableBatching() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_batch_);
+    flushBatch();
+    max_len_batch_ = 0;
+    enable_thread_flush_ = false;
+    cv_batch_.notify_all();
+  }
+
+  if (handle_thread_flush_) {
+    handle_thread_flush_->join();
+    handle_thread_flush_.reset();
+  }
+}
+
+bool Udpm::batch(const Header &header, const uint32_t group, const void *payload,
+                 const size_t len_payload) {
+  const size_t len_packet = sizeof(Header) + len_payload;
+  const size_t len_batch_header = sizeof(Header);
+
+  std::lock_guard<std::mutex> lock(mutex_batch_);
+  if (max_len_batch_ == 0 || len_batch_header + sizeof(uint32_t) + len_packet > max_len_batch_) {
+    // keep order of messages batched before
+    flushBatch();
+    return false;
+  }
+
+  // a batch is sent to a single group
+  if (batch_.size() + sizeof(uint32_t) + len_packet > max_len_batch_ || group != group_batch_) {
+    flushBatch();
+  }
+
+  if (batch_.empty()) {
+    group_batch_ = group;
+    Header header_batch = header;
+    header_batch.signature = signature_batch_message_;
+    header_batch.flags = 0;
+    header_batch.channel = 0;
+    header_batch.seq = 0;
+    header_batch.num_packets = 1;
+    header_batch.offset = 0;
+    batch_.resize(len_batch_header);
+    memcpy(batch_.data(), &header_batch, sizeof(header_batch));
+    deadline_batch_ = header.timestamp + max_delay_batch_;
+    cv_batch_.notify_all();
+  }
+
+  const uint32_t len = len_packet;
+  auto append = [this](const void *data, const size_t size) {
+    batch_.insert(batch_.end(), reinterpret_cast<const uint8_t *>(data),
+                  reinterpret_cast<const uint8_t *>(data) + size);
+  };
+  append(&len, sizeof(len));
+  append(&header, sizeof(header));
+  append(payload, len_payload);
+
+  if (batch_.size() + sizeof(uint32_t) + sizeof(Header) >= max_len_batch_) {
+    flushBatch();
+  }
+  return true;
+}
+
+void Udpm::flushBatch() {
+  if (batch_.empty()) {
+    return;
+  }
+
+  auto header = reinterpret_cast<Header *>(batch_.data());
+  header->len_payload = batch_.size() - sizeof(Header);
+  socket_->send({boost::asio::buffer((const void *)batch_.data(), batch_.size())}, group_batch_);
+  batch_.clear();
+}
+
+void Udpm::threadFlush() {
+  std::unique_lock<std::mutex> lock(mutex_batch_);
+  while (enable_thread_flush_) {
+    if (batch_.empty()) {
+      cv_batch_.wait(lock);
+      continue;
+    }
 
-    if (header->num_packets == 1) {
-      std::shared_ptr<uint8_t> payload(new uint8_t[header->len_payload],
-                                       std::default_delete<uint8_t[]>());
-      memcpy(payload.get(), data, header->len_payload);
-      callback_recv_(channel, payload, header->len_payload,
-                     (header->signature == signature_shm_message_));
+    const auto t = nowMonotonic();
+    if (t >= deadline_batch_) {
+      flushBatch();
     } else {
-      auto it = msg_buffer_.find(header->id);
-      if (it == msg_buffer_.end()) {
-        MessageBuffer buffer;
-        buffer.header = *header;
-        buffer.channel = channel;
-        buffer.num_received = 0;
-        buffer.payload.reset(new uint8_t[header->len_payload], std::default_delete<uint8_t[]>());
-        msg_buffer_[header->id] = buffer;
-        it = msg_buffer_.find(header->id);
+      cv_batch_.wait_for(lock, std::chrono::microseconds(deadline_batch_ - t));
+    }
+  }
+}
+
+std::unordered_map<std::string, ChannelStatistics> Udpm::statistics() const {
+  std::lock_guard<std::mutex> lock(mutex_tracking_);
+  std::unordered_map<std::string, ChannelStatistics> statistics;
+  for (const auto &item : tracking_) {
+    statistics[item.first] = item.second.statistics;
+  }
+  return statistics;
+}
+
+void Udpm::setQueueOptions(const QueueOptions &packets, const size_t max_incomplete_messages) {
+  msg_queue_->setOptions(packets);
+  max_msg_buffer_.store(std::max<size_t>(max_incomplete_messages, 1));
+}
+
+QueueStatistics Udpm::reassemblyStatistics() const {
+  QueueStatistics statistics;
+  statistics.size = size_msg_buffer_.load();
+  statistics.capacity = max_msg_buffer_.load();
+  statistics.num_dropped = num_dropped_msg_buffer_.load();
+  return statistics;
+}
+
+void Udpm::updateStatistics(const Header &header, const std::string &channel) {
+  const auto t = nowMonotonic();
+  std::lock_guard<std::mutex> lock(mutex_tracking_);
+  auto &tracking = tracking_[channel];
+  auto &statistics = tracking.statistics;
+
+  // gaps of sequence number per source, reordered or restarted senders only resync
+  auto it = tracking.seq.find(header.source);
+  if (it != tracking.seq.end() && header.seq > it->second + 1) {
+    statistics.num_lost += header.seq - it->second - 1;
+  }
+  tracking.seq[header.source] = header.seq;
+
+  const uint64_t latency = (t > header.timestamp ? t - header.timestamp : 0);
+  ++statistics.num_messages;
+  statistics.latency_last = latency;
+  statistics.latency_max = std::max(statistics.latency_max, latency);
+  statistics.latency_sum += latency;
+}
+
+void Udpm::announce(const uint64_t id, const std::string &channel, const uint64_t segment) {
+  const Peer peer{host_, segment};
+  std::string payload(reinterpret_cast<const char *>(&peer), sizeof(peer));
+  payload += channel;
+
+  Header header;
+  header.signature = signature_announce_message_;
+  header.version = kVersionHeader;
+  header.flags = 0;
+  header.source = source_;
+  header.id = 0;
+  header.channel = id;
+  header.len_payload = payload.size();
+  header.num_packets = 1;
+  header.offset = 0;
+  header.seq = 0;
+  header.timestamp = nowMonotonic();
+  send(header, 0, payload.data(), payload.size());
+}
+
+void Udpm::announceInterests(const bool immediately) {
+  const auto t = nowMonotonic();
+  if (t - t_announce_interests_ < (immediately ? kIntervalQuery : kIntervalAnnounce)) {
+    return;
+  }
+  t_announce_interests_ = t;
+
+  std::lock_guard<std::mutex> lock(mutex_groups_);
+  for (const auto &item : patterns_) {
+    announceInterest(item.first.first, item.first.second, false);
+  }
+}
+
+void Udpm::announceInterest(const std::string &pattern, const uint64_t segment,
+                            const bool withdrawn) {
+  const Peer peer{host_, segment};
+  std::string payload(reinterpret_cast<const char *>(&peer), sizeof(peer));
+  payload += pattern;
+
+  Header header;
+  header.signature = signature_interest_message_;
+  header.version = kVersionHeader;
+  header.flags = (withdrawn ? kFlagWithdrawn : 0);
+  header.source = source_;
+  header.id = 0;
+  // key of interest, told apart by segment as well
+  header.channel = channelId(pattern) ^ segment;
+  header.len_payload = payload.size();
+  header.num_packets = 1;
+  header.offset = 0;
+  header.seq = 0;
+  header.timestamp = nowMonotonic();
+  send(header, 0, payload.data(), payload.size());
+}
+
+void Udpm::handleInterest(const Header &header, const uint8_t *data, const size_t len_data) {
+  // subscribers of this instance are known without announcements
+  if (header.source == source_ || len_data < sizeof(Peer)) {
+    return;
+  }
+
+  const auto key = std::make_pair(header.source, header.channel);
+  std::lock_guard<std::mutex> lock(mutex_interests_);
+  if (header.flags & kFlagWithdrawn) {
+    generation_interests_ += interests_.erase(key);
+    return;
+  }
+
+  auto it = interests_.find(key);
+  if (it == interests_.end()) {
+    Interest interest;
+    memcpy(&interest.peer, data, sizeof(Peer));
+    interest.pattern.assign(reinterpret_cast<const char *>(data + sizeof(Peer)),
+                            len_data - sizeof(Peer));
+    it = interests_.emplace(key, interest).first;
+    ++generation_interests_;
+  }
+  it->second.t_last = nowMonotonic();
+}
+
+int Udpm::sharesSegment(const Header &header, const uint64_t segment) const {
+  auto it = peers_.find(std::make_pair(header.source, header.channel));
+  if (it == peers_.end()) {
+    return -1;
+  }
+  return (segment != 0 && it->second.host == host_ && it->second.segment == segment) ? 1 : 0;
+}
+
+bool Udpm::accepts(const Header &header, const uint64_t segment) const {
+  if (header.signature == signature_shm_message_) {
+    return sharesSegment(header, segment) != 0;
+  }
+  if (header.flags & kFlagMirrored) {
+    return sharesSegment(header, segment) != 1;
+  }
+  return true;
+}
+
+void Udpm::announce(Publication *publication) {
+  uint64_t segment = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_send_);
+    if (!dueAnnounce(publication, nowMonotonic())) {
+      return;
+    }
+    segment = publication->segment;
+  }
+  announce(publication->id, publication->name, segment);
+}
+
+bool Udpm::dueAnnounce(Publication *publication, const uint64_t t) {
+  if (publication->t_announce != 0 && t - publication->t_announce < kIntervalAnnounce) {
+    return false;
+  }
+  if (publication->t_announce == 0) {
+    publication->t_announce_first = t;
+  }
+  publication->t_announce = t;
+  return true;
+}
+
+Audience Udpm::audience(Publication *publication) {
+  const auto t = nowMonotonic();
+
+  // interests announced before receiving, or before the channel was announced, may be missed
+  bool known = false;
+  uint64_t segment = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_send_);
+    const uint64_t t_receiving = t_receiving_.load();
+    known = t_receiving != 0 && publication->t_announce != 0 &&
+            t - std::max(t_receiving, publication->t_announce_first) >= kWarmUpDiscovery;
+    segment = publication->segment;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_interests_);
+  if (publication->t_audience != 0 && publication->generation_audience == generation_interests_ &&
+      publication->segment_audience == segment && t - publication->t_audience < kIntervalAnnounce) {
+    publication->audience.known = known;
+    return publication->audience;
+  }
+
+  const std::string &channel = publication->name;
+
+  Audience audience;
+  {
+    std::lock_guard<std::mutex> lock_groups(mutex_groups_);
+    for (const auto &item : patterns_) {
+      if (matchesPattern(channel, item.first.first)) {
+        (segment != 0 && item.first.second == segment ? audience.local_shm : audience.others) =
+            true;
+      }
+    }
+  }
+  for (auto it = interests_.begin(); it != interests_.end();) {
+    // peers gone without withdrawing their interests
+    if (t - it->second.t_last > kTimeoutInterest) {
+      it = interests_.erase(it);
+      ++generation_interests_;
+      continue;
+    }
+    if (matchesPattern(channel, it->second.pattern)) {
+      const Peer &peer = it->second.peer;
+      if (segment != 0 && peer.host == host_ && peer.segment == segment) {
+        audience.local_shm = true;
+      } else {
+        audience.others = true;
       }
+    }
+    ++it;
+  }
+
+  audience.known = known;
+  publication->audience = audience;
+  publication->generation_audience = generation_interests_;
+  publication->segment_audience = segment;
+  publication->t_audience = t;
+  return audience;
+}
 
-      memcpy(it->second.payload.get() + header->offset, data,
-             packet.second - sizeof(Header) - channel.size() - 1);
-      if (++it->second.num_received == it->second.header.num_packets) {
-        callback_recv_(it->second.channel, it->second.payload, it->second.header.len_payload,
-                       (it->second.header.signature == signature_shm_message_));
-        msg_buffer_.erase(it);
+bool Udpm::hasSubscribers(Publication *publication) {
+  const auto t = nowMonotonic();
+  const uint64_t generation = generation_interests_.load();
+  if (t < publication->t_verdict.load()) {
+    const uint64_t verdict = publication->verdict.load();
+    if (verdict >> 1 == generation) {
+      return verdict & 1;
+    }
+  }
+
+  announce(publication);
+  const auto audience = this->audience(publication);
+  const bool subscribed = !audience.known || audience.local_shm || audience.others;
+  uint64_t t_announce = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_send_);
+    t_announce = publication->t_announce;
+  }
+  // valid until the next announcement is due, subscribers becoming known after warming up are
+  // noticed up to an interval late
+  publication->verdict.store(generation << 1 | (subscribed ? 1 : 0));
+  publication->t_verdict.store(t_announce + kIntervalAnnounce);
+  return subscribed;
+}
+
+void Udpm::setUrgent(const std::string &channel, const bool urgent) {
+  auto publication = this->publication(channel);
+  std::lock_guard<std::mutex> lock(mutex_send_);
+  publication->urgent = urgent;
+}
+
+void Udpm::query(const uint64_t id) {
+  const auto t = nowMonotonic();
+  auto &t_query = queries_[id];
+  if (t_query != 0 && t - t_query < kIntervalQuery) {
+    return;
+  }
+  t_query = t;
+
+  Header header;
+  header.signature = signature_query_message_;
+  header.version = kVersionHeader;
+  header.flags = 0;
+  header.source = source_;
+  header.id = 0;
+  header.channel = id;
+  header.len_payload = 0;
+  header.num_packets = 1;
+  header.offset = 0;
+  header.seq = 0;
+  header.timestamp = t;
+  send(header, 0, nullptr, 0);
+}
+
+void Udpm::park(const Header &header, const uint8_t *p, const size_t size) {
+  const auto t = nowMonotonic();
+
+  // channels of publishers gone make room first
+  if (num_parked_ >= kMaxUnresolvedPackets) {
+    for (auto it = unresolved_.begin(); it != unresolved_.end();) {
+      if (t - it->second.t_first >= kTimeoutUnresolved) {
+        num_parked_ -= it->second.packets.size();
+        num_unresolved_.fetch_add(it->second.packets.size());
+        it = unresolved_.erase(it);
+      } else {
+        ++it;
       }
     }
   }
+  if (num_parked_ >= kMaxUnresolvedPackets) {
+    num_unresolved_.fetch_add(1);
+    return;
+  }
+
+  auto &unresolved = unresolved_[header.channel];
+  if (unresolved.packets.empty()) {
+    unresolved.t_first = t;
+  }
+  unresolved.packets.emplace_back(p, p + size);
+  ++num_parked_;
 }
 
-size_t Udpm::send(const Header &header, const std::string &channel, const void *payload,
+size_t Udpm::send(const Header &header, const uint32_t group, const void *payload,
                   const size_t len_payload) {
   std::vector<boost::asio::const_buffers_1> buffers;
   buffers.emplace_back(&header, sizeof(header));
-  buffers.emplace_back(channel.data(), channel.size() + 1);
   buffers.emplace_back(payload, len_payload);
-  return socket_->send(buffers);
+  return socket_->send(buffers, group);
+}
+
+void Udpm::setGroups(const size_t num_groups) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_groups_);
+    hashed_groups_.clear();
+    for (size_t i = 0; i < std::max<size_t>(num_groups, 1); ++i) {
+      hashed_groups_.push_back(socket_->addGroup(static_cast<uint32_t>(i)));
+    }
+  }
+  updateMembership();
+}
+
+void Udpm::mapChannel(const std::string &channel, const std::string &multicast_addr) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_groups_);
+    mapped_groups_[channel] = socket_->addGroup(multicast_addr);
+  }
+  updateMembership();
+}
+
+void Udpm::join(const std::string &pattern, const uint64_t segment) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_groups_);
+    ++patterns_[std::make_pair(pattern, segment)];
+  }
+  ++generation_interests_;
+  updateMembership();
+  announceInterest(pattern, segment, false);
+}
+
+void Udpm::leave(const std::string &pattern, const uint64_t segment) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_groups_);
+    auto it = patterns_.find(std::make_pair(pattern, segment));
+    if (it == patterns_.end()) {
+      return;
+    }
+    if (--it->second == 0) {
+      patterns_.erase(it);
+      announceInterest(pattern, segment, true);
+    }
+  }
+  ++generation_interests_;
+  updateMembership();
+}
+
+uint32_t Udpm::group(const std::string &channel, const uint64_t id) const {
+  auto it = mapped_groups_.find(channel);
+  if (it != mapped_groups_.end()) {
+    return it->second;
+  }
+  return hashed_groups_[id % hashed_groups_.size()];
+}
+
+void Udpm::updateMembership() {
+  std::lock_guard<std::mutex> lock_send(mutex_send_);
+  std::lock_guard<std::mutex> lock(mutex_groups_);
+  for (auto &item : publications_) {
+    item.second.group = group(item.first, item.second.id);
+  }
+
+  // announcements and queries go to group 0
+  std::set<uint32_t> groups{0};
+  std::set<uint64_t> channels;
+  bool all_channels = false;
+  for (const auto &item : patterns_) {
+    std::string channel;
+    if (literalPattern(item.first.first, &channel)) {
+      const auto id = channelId(channel);
+      groups.insert(group(channel, id));
+      channels.insert(id);
+    } else {
+      all_channels = true;
+      groups.insert(hashed_groups_.begin(), hashed_groups_.end());
+      for (const auto &mapped : mapped_groups_) {
+        groups.insert(mapped.second);
+      }
+    }
+  }
+  socket_->setMembership(groups);
+  updateFilter(channels, all_channels);
+}
+
+void Udpm::updateFilter(const std::set<uint64_t> &channels, const bool all_channels) {
+#ifdef __linux__
+  // the filter of a udp socket sees the udp header before payload, and loads words big-endian
+  const uint32_t offset_signature = kLenUdpHeader + offsetof(Header, signature);
+  const uint32_t offset_channel = kLenUdpHeader + offsetof(Header, channel);
+  const uint32_t kAccept = 0xffffffff;
+  const uint32_t kDrop = 0;
+
+  // 5 instructions per channel after 4 of the prologue and 1 of the epilogue
+  if (all_channels || 4 + 5 * channels.size() + 1 > BPF_MAXINSNS) {
+    socket_->setFilter(nullptr, 0);
+    return;
+  }
+
+  std::vector<sock_filter> program;
+  // data packets carry a single channel, while others are left to user space
+  program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset_signature));
+  program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(signature_udpm_message_), 2, 0));
+  program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(signature_shm_message_), 1, 0));
+  program.push_back(BPF_STMT(BPF_RET | BPF_K, kAccept));
+  for (auto id : channels) {
+    // words as laid out in Header::channel, whatever the byte order of host
+    uint32_t words[2];
+    static_assert(sizeof(words) == sizeof(Header::channel), "channel must be of two words");
+    memcpy(words, &id, sizeof(words));
+    program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset_channel));
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(words[0]), 0, 3));
+    program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset_channel + 4));
+    program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(words[1]), 0, 1));
+    program.push_back(BPF_STMT(BPF_RET | BPF_K, kAccept));
+  }
+  program.push_back(BPF_STMT(BPF_RET | BPF_K, kDrop));
+  socket_->setFilter(program.data(), program.size());
+#else
+  (void)channels;
+  (void)all_channels;
+#endif
 }
 
 }  // namespace shame
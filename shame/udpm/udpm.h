@@ -8,39 +8,123 @@
 
 #pragma once
 
+#include <google/protobuf/message_lite.h>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <random>
+#include <set>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+#include "shame/common/thread_safe_queue.h"
+#include "shame/statistics.h"
 
 namespace shame {
 
-template <typename T>
-class ThreadSafeQueue;
 class Socket;
 
+// bump on any change of Header, packets of other versions are dropped
+static const uint16_t kVersionHeader = 3;
+
+// a packet is Header followed by payload, names of channels are announced separately
+// message also delivered to subscribers in the process of sender, dropped on receiving there
+static const uint16_t kFlagDeliveredLocally = 0x1;
+// message also sent via shared memory, dropped by receivers on the host of sender sharing its
+// segment
+static const uint16_t kFlagMirrored = 0x2;
+// interest in a channel withdrawn by subscriber
+static const uint16_t kFlagWithdrawn = 0x4;
+// message of an urgent channel, overtaking other messages on receivers, never batched
+static const uint16_t kFlagUrgent = 0x8;
+
+// where a peer runs, prefix of announcements of channels and of interests in channels
+struct Peer {
+  // see hostId()
+  uint64_t host;
+  // hash of name of shared memory segment, 0 for none
+  uint64_t segment;
+};
+
+// subscribers of a channel known by discovery
+struct Audience {
+  // on this host sharing the segment of the publishing instance
+  bool local_shm = false;
+  // on other hosts, or without the segment
+  bool others = false;
+  // whether subscribers in other instances are all known, see Udpm::audience
+  bool known = false;
+};
+
 struct Header {
   uint32_t signature;
+  uint16_t version;
+  uint16_t flags;
+  // random id of sender instance
+  uint32_t source;
+  // random id of message
   uint32_t id;
+  // id of channel, see channelId()
+  uint64_t channel;
   uint32_t len_payload;
   uint32_t num_packets;
   uint32_t offset;
+  // sequence number of message per channel per sender
+  uint32_t seq;
+  // monotonic timestamp in microseconds on sending
+  uint64_t timestamp;
 };
 
 struct MessageBuffer {
   Header header;
-  std::string channel;
+  // name of channel owned by the table of resolved channels
+  const std::string *channel;
   uint32_t num_received;
   std::shared_ptr<uint8_t> payload;
 };
 
+// state of a channel published by this instance, never released once created
+struct Publication {
+  std::string name;
+  uint64_t id = 0;
+  // index of multicast group
+  uint32_t group = 0;
+  uint32_t seq = 0;
+  // see Udpm::setUrgent
+  bool urgent = false;
+  // hash of name of shared memory segment of instances publishing it, announced with its name,
+  // 0 for none
+  uint64_t segment = 0;
+  // monotonic timestamps of first and last announcements of name
+  uint64_t t_announce_first = 0;
+  uint64_t t_announce = 0;
+  // cached subscribers of segment_audience, see Udpm::audience
+  Audience audience;
+  uint64_t segment_audience = 0;
+  uint64_t generation_audience = 0;
+  uint64_t t_audience = 0;
+  // verdict of Udpm::hasSubscribers in the lowest bit, with generation of interests it was made
+  // in above, valid until the monotonic timestamp, read without lock
+  std::atomic<uint64_t> verdict{0};
+  std::atomic<uint64_t> t_verdict{0};
+};
+
 class Udpm {
  public:
+  // callbacks on messages, with whether via shared memory and whether urgent
+  using Callback = std::function<void(const std::string &, const std::shared_ptr<uint8_t> &,
+                                      const size_t, const bool, const bool)>;
+  using LocalCallback =
+      std::function<void(const std::string &,
+                         const std::shared_ptr<const google::protobuf::MessageLite> &, const bool,
+                         const bool)>;
+
   /**
    * @brief constructor of Udpm
    * @param multicast_addr address of udpm multicast
@@ -56,28 +140,218 @@ class Udpm {
 
  public:
   /**
-   * @brief start async receiving
+   * @brief get the instance shared in process for the given multicast group, constructed on first
+   * use and destructed when no longer referenced, throws on fail
+   * @param multicast_addr address of udpm multicast
+   * @param multicast_port port number of udpm multicast
+   * @param ttl time to live, messages would not leave localhost while ttl=0
+   */
+  static std::shared_ptr<Udpm> instance(const std::string &multicast_addr,
+                                        const uint16_t multicast_port, const int ttl);
+
+  /**
+   * @brief add callback function on receiving, every completed message is passed to all
+   * listeners
    * @param callback_recv callback function on receiving
+   * @param callback_local callback function on messages published in process by sendLocal
+   * @param segment hash of name of shared memory segment of the listening instance, 0 for none,
+   * messages via shared memory only reach listeners sharing the segment of sender, which do not
+   * get mirrored copies
+   * @return id of listener
+   */
+  uint64_t addListener(const Callback &callback_recv, const LocalCallback &callback_local,
+                       const uint64_t segment);
+
+  /**
+   * @brief remove callback function on receiving, waits for calls in progress on other threads,
+   * so that the callback is never called once this returns
+   * @param id id of listener returned by addListener
+   */
+  void removeListener(const uint64_t id);
+
+  /**
+   * @brief start async receiving, reference counted, receiving starts on the first call
    */
-  void startAsyncReceiving(
-      const std::function<void(const std::string &, const std::shared_ptr<uint8_t> &, const size_t,
-                               const bool)> &callback_recv);
+  void startAsyncReceiving();
 
   /**
-   * @brief stop async receiving
+   * @brief stop async receiving, reference counted, receiving stops when every call to
+   * startAsyncReceiving is matched
    */
   void stopAsyncReceiving();
 
+  /**
+   * @brief receive and reassemble pending packets on the caller thread, nothing is received
+   * while receiving asynchronously, calls on different threads are serialized
+   * @param max_packets max number of packets received, 0 for unlimited
+   * @return number of packets received
+   */
+  size_t receive(const size_t max_packets);
+
+  /**
+   * @brief get file descriptor readable when packets are pending
+   */
+  int fd();
+
+  /**
+   * @brief whether receiving asynchronously
+   */
+  bool receivingAsync() const { return enable_thread_pack_.load(); }
+
   /**
    * @brief send raw data
    * @param channel channel name
    * @param payload pointer to data to be sent
    * @param len_payload length of data in bytes to be sent
    * @param shared_memory whether use shared memory
+   * @param delivered_locally whether delivered to listeners in process by sendLocal, so that
+   * the copy received from network is dropped
    * @return bytes transfered
    */
   size_t send(const std::string &channel, const void *payload, const size_t len_payload,
-              const bool shared_memory);
+              const bool shared_memory, const bool delivered_locally = false);
+
+  /**
+   * @brief send raw data of a resolved channel, without any lookup by name
+   * @param publication resolved channel returned by publication
+   * @param payload pointer to data to be sent
+   * @param len_payload length of data in bytes to be sent
+   * @param shared_memory whether use shared memory
+   * @param delivered_locally whether delivered to listeners in process by sendLocal
+   * @return bytes transfered
+   */
+  size_t send(Publication *publication, const void *payload, const size_t len_payload,
+              const bool shared_memory, const bool delivered_locally = false,
+              const bool mirrored = false);
+
+  /**
+   * @brief announce name of a channel unless announced within a second, which keeps subscribers
+   * announcing their interests while nothing is sent
+   * @param publication resolved channel returned by publication
+   */
+  void announce(Publication *publication);
+
+  /**
+   * @brief get subscribers of a channel announced by peers and subscribed in process, discovered
+   * while receiving only, cached for up to a second, subscribers in other instances are known
+   * once receiving asynchronously for a while since the channel was first announced
+   * @param publication resolved channel returned by publication
+   */
+  Audience audience(Publication *publication);
+
+  /**
+   * @brief tell whether a channel may have any subscriber, false only if known to have none, see
+   * audience, keeps the channel announced, the verdict is cached in the publication until the
+   * next announcement is due or interests change, so that no lock is taken in between
+   * @param publication resolved channel returned by publication
+   */
+  bool hasSubscribers(Publication *publication);
+
+  /**
+   * @brief resolve channel for publishing, valid for lifetime of this instance
+   * @param channel channel name
+   * @param segment hash of name of shared memory segment of the publishing instance, announced
+   * with the channel and compared with those of subscribers, 0 for none or to leave it unchanged
+   */
+  Publication *publication(const std::string &channel, const uint64_t segment = 0);
+
+  /**
+   * @brief mark messages of a channel urgent, which are sent without batching, and overtake
+   * messages of other channels in queues of receivers
+   * @param channel channel name
+   * @param urgent whether urgent
+   */
+  void setUrgent(const std::string &channel, const bool urgent);
+
+  /**
+   * @brief pass a message object to all listeners in process without any copy
+   * @param publication resolved channel returned by publication
+   * @param msg protobuf message
+   * @param shared_memory whether also sent via shared memory
+   * @return whether there was any listener
+   */
+  bool sendLocal(Publication *publication,
+                 const std::shared_ptr<const google::protobuf::MessageLite> &msg,
+                 const bool shared_memory);
+
+  /**
+   * @brief get statistics of received messages
+   * @return statistics per channel
+   */
+  std::unordered_map<std::string, ChannelStatistics> statistics() const;
+
+  /**
+   * @brief enable coalescing of small messages, possibly of different channels, into a single
+   * datagram, which is flushed when full or on deadline
+   * @param max_len_batch max length of batch datagram in bytes, limited by max length of packet
+   * @param max_delay max delay in microseconds of a message waiting in batch
+   */
+  void enableBatching(const size_t max_len_batch, const uint64_t max_delay);
+
+  /**
+   * @brief flush pending batch and disable coalescing of small messages
+   */
+  void disableBatching();
+
+  /**
+   * @brief set capacity and overflow policy of queue of received packets
+   * @param packets options of queue of received packets
+   * @param max_incomplete_messages max number of messages being reassembled, the oldest is
+   * dropped on overflow
+   */
+  void setQueueOptions(const QueueOptions &packets, const size_t max_incomplete_messages);
+
+  /**
+   * @brief get statistics of queue of received packets
+   */
+  QueueStatistics packetQueueStatistics() { return msg_queue_->statistics(); }
+
+  /**
+   * @brief get statistics of messages being reassembled, dropped ones are incomplete forever
+   */
+  QueueStatistics reassemblyStatistics() const;
+
+  /**
+   * @brief whether queue of received packets is filled to half of its capacity or more
+   */
+  bool congested() { return msg_queue_->congested(); }
+
+  /**
+   * @brief get number of packets dropped as their channel ids were not resolved to names in time,
+   * packets are kept until then
+   */
+  uint64_t numUnresolved() const { return num_unresolved_.load(); }
+
+  /**
+   * @brief spread channels over num_groups multicast groups by hash of channel name, at
+   * consecutive addresses starting from the one of constructor
+   * @param num_groups number of groups, 1 to send every channel to the group of constructor
+   */
+  void setGroups(const size_t num_groups);
+
+  /**
+   * @brief send a channel to the given multicast group, overriding the hashed one
+   * @param channel channel name
+   * @param multicast_addr address of udpm multicast on the port of constructor
+   */
+  void mapChannel(const std::string &channel, const std::string &multicast_addr);
+
+  /**
+   * @brief join groups of channels matching pattern, literal channel names join their own group
+   * only, while regular expressions join all groups, data packets of other channels are dropped
+   * in kernel if only literal channel names are joined, interest in them is announced with the
+   * shared memory segment of the subscribing instance
+   * @param pattern channel name or regular expression
+   * @param segment hash of name of shared memory segment of the subscribing instance, 0 for none
+   */
+  void join(const std::string &pattern, const uint64_t segment);
+
+  /**
+   * @brief leave groups joined by join with the same pattern and segment
+   * @param pattern channel name or regular expression
+   * @param segment hash of name of shared memory segment of the subscribing instance, 0 for none
+   */
+  void leave(const std::string &pattern, const uint64_t segment);
 
  protected:
   /**
@@ -91,27 +365,241 @@ class Udpm {
   void threadPack();
 
   /**
-   * @brief inner function to send message with header, channel and payload
+   * @brief inner function to handle a received packet, unpacks batch
+   */
+  void handlePacket(const uint8_t *p, const size_t size);
+
+  /**
+   * @brief inner function to append a packet to batch, false if it does not fit in batch
+   */
+  bool batch(const Header &header, const uint32_t group, const void *payload,
+             const size_t len_payload);
+
+  /**
+   * @brief inner function to announce name of channel with segment of its publishers
+   */
+  void announce(const uint64_t id, const std::string &channel, const uint64_t segment);
+
+  /**
+   * @brief inner function to announce interests in channels subscribed, at most once a second, or
+   * at most every 100ms if immediately
    */
-  size_t send(const Header &header, const std::string &channel, const void *payload,
+  void announceInterests(const bool immediately);
+
+  /**
+   * @brief inner function to tell whether name of a channel is due to be announced, and mark it
+   * announced, with mutex_send_ locked
+   */
+  bool dueAnnounce(Publication *publication, const uint64_t t);
+
+  /**
+   * @brief inner function to announce or withdraw interest in a channel of subscribers with a
+   * segment
+   */
+  void announceInterest(const std::string &pattern, const uint64_t segment, const bool withdrawn);
+
+  /**
+   * @brief inner function to handle announcement of interest of a peer
+   */
+  void handleInterest(const Header &header, const uint8_t *data, const size_t len_data);
+
+  /**
+   * @brief inner function to check whether sender of a message shares a shared memory segment on
+   * the same host
+   * @return 1 if shared, 0 if not, -1 if sender not announced yet
+   */
+  int sharesSegment(const Header &header, const uint64_t segment) const;
+
+  /**
+   * @brief inner function to tell whether a listener of segment takes a message, messages via
+   * shared memory are for listeners sharing the segment of sender, which drop mirrored copies via
+   * udpm, unknown senders are given the benefit of the doubt
+   */
+  bool accepts(const Header &header, const uint64_t segment) const;
+
+  /**
+   * @brief inner function to tell whether any listener takes a message, checked before
+   * reassembling
+   */
+  bool accepted(const Header &header);
+
+  /**
+   * @brief inner function to query name of channel from its publishers and receivers which
+   * resolved it
+   */
+  void query(const uint64_t id);
+
+  /**
+   * @brief inner function to keep a packet of an unresolved channel until its name is announced
+   */
+  void park(const Header &header, const uint8_t *p, const size_t size);
+
+  /**
+   * @brief inner function to send pending batch, caller holds mutex_batch_
+   */
+  void flushBatch();
+
+  /**
+   * @brief inner thread to flush batch on deadline
+   */
+  void threadFlush();
+
+  /**
+   * @brief inner function to send message with header and payload to a group
+   */
+  size_t send(const Header &header, const uint32_t group, const void *payload,
               const size_t len_payload);
 
+  /**
+   * @brief inner function to get group of channel, caller holds mutex_groups_
+   */
+  uint32_t group(const std::string &channel, const uint64_t id) const;
+
+  /**
+   * @brief inner function to apply changes of groups and patterns to publications, membership and
+   * kernel filter of received packets
+   */
+  void updateMembership();
+
+  /**
+   * @brief inner function to install kernel filter passing data packets of given channels only,
+   * packets of all channels are passed if all_channels
+   */
+  void updateFilter(const std::set<uint64_t> &channels, const bool all_channels);
+
+  /**
+   * @brief inner function to call f on every listener not being removed, counting calls in
+   * progress for removeListener
+   */
+  template <typename F>
+  void forEachListener(F f);
+
+  /**
+   * @brief inner function to pass a completed message to all listeners taking it
+   */
+  void notify(const Header &header, const std::string &channel,
+              const std::shared_ptr<uint8_t> &payload);
+
+  /**
+   * @brief inner function to stop threads of async receiving
+   */
+  void stopReceiving();
+
+  /**
+   * @brief inner function to update statistics on a completed message
+   */
+  void updateStatistics(const Header &header, const std::string &channel);
+
  protected:
   const uint32_t signature_udpm_message_;
   const uint32_t signature_shm_message_;
+  const uint32_t signature_batch_message_;
+  const uint32_t signature_announce_message_;
+  const uint32_t signature_query_message_;
+  const uint32_t signature_interest_message_;
 
   std::shared_ptr<Socket> socket_;
   std::shared_ptr<ThreadSafeQueue<std::pair<std::shared_ptr<uint8_t>, size_t>>> msg_queue_;
-  std::unordered_map<uint32_t, MessageBuffer> msg_buffer_;
+  // incomplete messages by source in high and id in low 32 bits, as ids are random per source
+  std::unordered_map<uint64_t, MessageBuffer> msg_buffer_;
+  std::atomic<size_t> max_msg_buffer_;
+  std::atomic<size_t> size_msg_buffer_;
+  std::atomic<uint64_t> num_dropped_msg_buffer_;
 
-  std::function<void(const std::string &, const std::shared_ptr<uint8_t> &, const size_t,
-                     const bool)>
-      callback_recv_;
+  struct Calls {
+    // calls in progress on any thread
+    std::atomic<int> num{0};
+    std::atomic<bool> removed{false};
+  };
+  struct Listener {
+    uint64_t id;
+    Callback callback_recv;
+    LocalCallback callback_local;
+    uint64_t segment;
+    std::shared_ptr<Calls> calls;
+  };
+  // copied on write, so that listeners are called without lock
+  std::shared_ptr<const std::vector<Listener>> listeners_;
+  uint64_t next_listener_;
+  std::mutex mutex_listeners_;
+  // notified by the last call in progress of a removed listener
+  std::condition_variable cv_listeners_;
+  // listener whose callback is in progress on this thread
+  inline static thread_local const Calls *calling_ = nullptr;
+  size_t num_receivers_;
+  std::mutex mutex_receivers_;
   std::shared_ptr<std::thread> handle_thread_pack_;
   std::atomic<bool> enable_thread_pack_;
+  // monotonic timestamp since which receiving asynchronously, 0 if not
+  std::atomic<uint64_t> t_receiving_;
+  std::vector<uint8_t> buffer_receive_;
+  // held while receiving on the caller thread, which reassembles without other locks
+  std::mutex mutex_receive_;
 
   std::default_random_engine e_;
   std::uniform_int_distribution<uint32_t> d_;
+  const uint32_t source_;
+
+  std::unordered_map<std::string, Publication> publications_;
+  std::unordered_map<uint64_t, std::string> published_names_;
+  std::mutex mutex_send_;
+
+  // resolved names of channel ids, and timestamps of last queries of unresolved ones or of last
+  // answers to queries of resolved ones
+  std::unordered_map<uint64_t, std::string> channel_names_;
+  std::unordered_map<uint64_t, uint64_t> queries_;
+  struct Unresolved {
+    // monotonic timestamp of the first packet
+    uint64_t t_first;
+    std::vector<std::vector<uint8_t>> packets;
+  };
+  // packets of unresolved channel ids, handled once their names are announced
+  std::unordered_map<uint64_t, Unresolved> unresolved_;
+  size_t num_parked_ = 0;
+
+  // discovery of subscribers, peers announce their host and segment with their channels, by
+  // source and channel, as instances with different segments may share a source
+  const uint64_t host_;
+  std::map<std::pair<uint32_t, uint64_t>, Peer> peers_;
+  struct Interest {
+    Peer peer;
+    std::string pattern;
+    // monotonic timestamp of last announcement
+    uint64_t t_last;
+  };
+  // interests of peers by source and id of pattern
+  std::map<std::pair<uint32_t, uint64_t>, Interest> interests_;
+  // bumped whenever interests of peers or patterns subscribed change
+  std::atomic<uint64_t> generation_interests_;
+  uint64_t t_announce_interests_;
+  std::mutex mutex_interests_;
+  std::atomic<uint64_t> num_unresolved_;
+
+  // hashed and explicitly mapped groups of channels, and patterns subscribed with join by segment
+  // of subscribers
+  std::vector<uint32_t> hashed_groups_;
+  std::unordered_map<std::string, uint32_t> mapped_groups_;
+  std::map<std::pair<std::string, uint64_t>, size_t> patterns_;
+  std::mutex mutex_groups_;
+
+  struct ChannelTracking {
+    ChannelStatistics statistics;
+    // last sequence number per source
+    std::unordered_map<uint32_t, uint32_t> seq;
+  };
+  std::unordered_map<std::string, ChannelTracking> tracking_;
+  mutable std::mutex mutex_tracking_;
+
+  // batch datagram, Header followed by length and content of packets
+  std::vector<uint8_t> batch_;
+  uint32_t group_batch_;
+  size_t max_len_batch_;
+  uint64_t max_delay_batch_;
+  uint64_t deadline_batch_;
+  std::mutex mutex_batch_;
+  std::condition_variable cv_batch_;
+  std::shared_ptr<std::thread> handle_thread_flush_;
+  bool enable_thread_flush_;
 };
 
 }  // namespace shame
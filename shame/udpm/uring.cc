@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#ifdef SHAME_WITH_IO_URING
+
+#include "shame/udpm/uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace shame {
+
+Uring::Uring(const unsigned entries)
+    : fd_(-1),
+      ring_sq_(MAP_FAILED),
+      size_ring_sq_(0),
+      ring_cq_(MAP_FAILED),
+      size_ring_cq_(0),
+      sqes_(static_cast<io_uring_sqe *>(MAP_FAILED)),
+      size_sqes_(0),
+      sq_tail_local_(0),
+      num_pending_(0) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd_ < 0) {
+    throw std::runtime_error("io_uring_setup failed: " + std::string(strerror(errno)));
+  }
+
+  size_ring_sq_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_ring_cq_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+  if (single_mmap) {
+    size_ring_sq_ = size_ring_cq_ = std::max(size_ring_sq_, size_ring_cq_);
+  }
+
+  ring_sq_ = mmap(nullptr, size_ring_sq_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                  IORING_OFF_SQ_RING);
+  ring_cq_ = (single_mmap ? ring_sq_
+                          : mmap(nullptr, size_ring_cq_, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING));
+  size_sqes_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe *>(mmap(nullptr, size_sqes_, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+  if (ring_sq_ == MAP_FAILED || ring_cq_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+    const std::string error(strerror(errno));
+    release();
+    throw std::runtime_error("Failed to map io_uring: " + error);
+  }
+
+  auto sq = static_cast<uint8_t *>(ring_sq_);
+  sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  sq_tail_local_ = *sq_tail_;
+
+  auto cq = static_cast<uint8_t *>(ring_cq_);
+  cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+Uring::~Uring() { release(); }
+
+void Uring::release() {
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, size_sqes_);
+  }
+  if (ring_cq_ != MAP_FAILED && ring_cq_ != ring_sq_) {
+    munmap(ring_cq_, size_ring_cq_);
+  }
+  if (ring_sq_ != MAP_FAILED) {
+    munmap(ring_sq_, size_ring_sq_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+io_uring_sqe *Uring::sqe() {
+  const unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sq_tail_local_ - head > sq_mask_) {
+    return nullptr;
+  }
+
+  const unsigned index = sq_tail_local_ & sq_mask_;
+  io_uring_sqe *sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  ++sq_tail_local_;
+  ++num_pending_;
+  return sqe;
+}
+
+int Uring::submit(const unsigned wait_nr) {
+  __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+  const int ret = syscall(__NR_io_uring_enter, fd_, num_pending_, wait_nr,
+                          (wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0), nullptr, 0);
+  if (ret < 0) {
+    return -errno;
+  }
+  num_pending_ -= std::min<unsigned>(ret, num_pending_);
+  return ret;
+}
+
+unsigned Uring::rollback() {
+  // kernel consumes entries only within submit, without a polling thread of its own
+  const unsigned num = num_pending_;
+  sq_tail_local_ -= num;
+  num_pending_ = 0;
+  __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+  return num;
+}
+
+int Uring::wait(const unsigned wait_nr) {
+  const int ret =
+      syscall(__NR_io_uring_enter, fd_, 0, wait_nr, IORING_ENTER_GETEVENTS, nullptr, 0);
+  return (ret < 0 ? -errno : 0);
+}
+
+io_uring_cqe *Uring::peek() {
+  const unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+  return &cqes_[head & cq_mask_];
+}
+
+void Uring::advance() { __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE); }
+
+BufferPool::BufferPool(const unsigned entries, const size_t len_buffer)
+    : len_buffer_(len_buffer),
+      entries_(entries),
+      buffers_(new uint8_t[entries * len_buffer]),
+      num_lent_(0) {
+  returned_.reserve(entries_);
+  for (unsigned i = 0; i < entries_; ++i) {
+    returned_.push_back(i);
+  }
+}
+
+std::shared_ptr<uint8_t> BufferPool::take(const uint16_t id, const size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // keep a quarter of buffers for kernel
+    if (num_lent_ * 4 < entries_ * 3) {
+      ++num_lent_;
+      auto self = shared_from_this();
+      return std::shared_ptr<uint8_t>(buffer(id), [self, id](uint8_t *) { self->recycle(id); });
+    }
+  }
+
+  std::shared_ptr<uint8_t> copy(new uint8_t[size], std::default_delete<uint8_t[]>());
+  memcpy(copy.get(), buffer(id), size);
+  std::lock_guard<std::mutex> lock(mutex_);
+  returned_.push_back(id);
+  return copy;
+}
+
+void BufferPool::reclaim(std::vector<uint16_t> *ids) {
+  ids->clear();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ids->swap(returned_);
+  }
+  std::sort(ids->begin(), ids->end());
+}
+
+void BufferPool::recycle(const uint16_t id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  --num_lent_;
+  returned_.push_back(id);
+}
+
+}  // namespace shame
+
+#endif
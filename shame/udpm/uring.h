@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2019 Hongxin Liu. All rights reserved.
+ * Licensed under the MIT License. See the LICENSE file for details.
+ *
+ * Author: Hongxin Liu <hongxinliu.com> <github.com/hongxinliu>
+ * Date: Sept.08, 2019
+ */
+
+#pragma once
+
+#ifdef SHAME_WITH_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace shame {
+
+/**
+ * @brief minimal io_uring by system calls, submission and completion are not thread-safe
+ */
+class Uring {
+ public:
+  /**
+   * @brief constructor of Uring, throws on fail, e.g. unsupported by kernel
+   * @param entries number of entries of submission queue
+   */
+  explicit Uring(const unsigned entries);
+
+  /**
+   * @brief destructor, unmaps rings and closes, requests in flight have to be completed before, as
+   * kernel may still write to their buffers until then
+   */
+  ~Uring();
+
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+ public:
+  /**
+   * @brief get a cleared entry of submission queue
+   * @return nullptr if queue is full
+   */
+  io_uring_sqe *sqe();
+
+  /**
+   * @brief submit entries got and not consumed by kernel yet, and wait for completions, entries
+   * not consumed, e.g. on error, stay pending for the next submission or rollback
+   * @param wait_nr number of completions to wait for, 0 to not wait, waiting may be interrupted
+   * @return number of entries consumed by kernel, or negative errno
+   */
+  int submit(const unsigned wait_nr = 0);
+
+  /**
+   * @brief withdraw entries pending, i.e. got and not consumed by kernel, so that none of them
+   * completes
+   * @return number of entries withdrawn
+   */
+  unsigned rollback();
+
+  /**
+   * @brief wait for completions without submitting, so that another thread may get and submit
+   * entries meanwhile
+   * @param wait_nr number of completions to wait for
+   * @return 0 on success, or negative errno
+   */
+  int wait(const unsigned wait_nr);
+
+  /**
+   * @brief get the next completion without waiting
+   * @return nullptr if none, otherwise valid until advance
+   */
+  io_uring_cqe *peek();
+
+  /**
+   * @brief mark the completion returned by peek seen
+   */
+  void advance();
+
+ protected:
+  /**
+   * @brief inner function to unmap rings and close
+   */
+  void release();
+
+ protected:
+  int fd_;
+  // mapped rings, the completion ring shares the mapping of submission ring if supported
+  void *ring_sq_;
+  size_t size_ring_sq_;
+  void *ring_cq_;
+  size_t size_ring_cq_;
+  io_uring_sqe *sqes_;
+  size_t size_sqes_;
+
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned sq_mask_;
+  unsigned *sq_array_;
+  unsigned sq_tail_local_;
+  // entries got and not consumed by kernel, the last ones before sq_tail_local_
+  unsigned num_pending_;
+
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe *cqes_;
+};
+
+/**
+ * @brief buffers of packets provided to kernel for receiving, lent to consumers after receiving
+ * and returned to be provided again on release from any thread
+ */
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+ public:
+  /**
+   * @brief constructor of BufferPool, all buffers are to be provided at first
+   * @param entries number of buffers
+   * @param len_buffer length of each buffer in bytes
+   */
+  BufferPool(const unsigned entries, const size_t len_buffer);
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+ public:
+  /**
+   * @brief get buffer of id
+   */
+  uint8_t *buffer(const uint16_t id) { return buffers_.get() + id * len_buffer_; }
+
+  /**
+   * @brief get length of each buffer in bytes
+   */
+  size_t lengthOfBuffer() const { return len_buffer_; }
+
+  /**
+   * @brief take a buffer filled by kernel, returned on release of the last copy, or copied out and
+   * returned right away while most buffers are lent, so that kernel never runs out of buffers
+   * @param id id of buffer from completion
+   * @param size length of packet in buffer
+   */
+  std::shared_ptr<uint8_t> take(const uint16_t id, const size_t size);
+
+  /**
+   * @brief get buffers returned since last call, to be provided to kernel again
+   * @param ids output ids of buffers, sorted
+   */
+  void reclaim(std::vector<uint16_t> *ids);
+
+ protected:
+  /**
+   * @brief give a lent buffer back
+   */
+  void recycle(const uint16_t id);
+
+ protected:
+  const size_t len_buffer_;
+  const unsigned entries_;
+  std::unique_ptr<uint8_t[]> buffers_;
+  unsigned num_lent_;
+  std::vector<uint16_t> returned_;
+  std::mutex mutex_;
+};
+
+}  // namespace shame
+
+#endif